@@ -0,0 +1,203 @@
+/**
+ * Timing driver for the inner kernels, built by `make bench` and run by bench.py:
+ *   symnmf_bench [--threads t] [--repeat r] [--k k] kernel file
+ * kernel is matrix_mul (dense W * H), calc_sym (the packed similarity matrix) or update_H
+ * (one multiplicative update on the normalized packed W). Inputs are prepared first and not
+ * timed; the kernel then runs once to warm up and r more times, and the best and median
+ * wall-clock times go to stdout as one JSON object. FLOP counts are left to bench.py.
+ *
+ *   symnmf_bench exec command [args...]
+ * runs command and reports its wall-clock time and peak resident set size on stderr. Linux
+ * carries the high-water mark of the exec'ing process over into the new program, so a
+ * program started straight from Python would report at least the interpreter's size.
+ */
+#define _XOPEN_SOURCE 600
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include "symnmf.h"
+#include "mat_utils.h"
+#include "utils.h"
+#include "threadpool.h"
+#include "rng.h"
+
+#define DEFAULT_REPEAT 5
+#define MAX_REPEAT 1000
+#define DEFAULT_K 8
+#define BENCH_SEED 1234
+
+/* Everything a kernel works on, built by prepare() */
+typedef struct {
+    Matrix *X; /* the points */
+    int k;
+    Matrix *A; /* matrix_mul: dense sym(X) */
+    SymMatrix *W; /* update_H: normalized packed W */
+    Matrix *H; /* matrix_mul, update_H: n x k */
+    Matrix *H_next; /* update_H: destination */
+    SymnmfWorkspace *workspace; /* update_H: the buffers, allocated once */
+} BenchData;
+
+typedef int (*BenchKernel)(BenchData *data); /* one timed run, 0 on success */
+
+static int run_matrix_mul(BenchData *data){
+  Matrix *C = matrix_mul(data->A, data->H);
+  free_matrix(C);
+  return (C != NULL) ? 0 : -1;
+}
+
+static int run_calc_sym(BenchData *data){
+  SymMatrix *S = calc_sym_packed(data->X, NULL);
+  free_sym_matrix(S);
+  return (S != NULL) ? 0 : -1;
+}
+
+static int run_update_H(BenchData *data){
+  double squared_difference;
+  return symnmf_step(data->H_next, data->H, data->W, data->workspace, &squared_difference);
+}
+
+static const struct {
+    const char *name;
+    BenchKernel run;
+} kernels[] = {
+  {"matrix_mul", run_matrix_mul},
+  {"calc_sym", run_calc_sym},
+  {"update_H", run_update_H}
+};
+
+#define KERNEL_COUNT ((int)(sizeof(kernels) / sizeof(kernels[0])))
+
+static double seconds_now(void){
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (double)t.tv_sec + (double)t.tv_nsec * 1e-9;
+}
+
+/* Runs argv[0] with its arguments and reports on stderr, returns its exit status */
+static int exec_measured(char *argv[]){
+  struct rusage usage;
+  double start = seconds_now();
+  int status;
+  pid_t child = fork();
+  if (child == 0) {
+    execvp(argv[0], argv);
+    _exit(127);
+  }
+  if (child < 0 || waitpid(child, &status, 0) != child || getrusage(RUSAGE_CHILDREN, &usage) != 0) {
+    return 1;
+  }
+  fprintf(stderr, "{\"seconds\": %.9g, \"peak_rss_kb\": %ld}\n", seconds_now() - start,
+          (long)usage.ru_maxrss);
+  return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+}
+
+static int compare_doubles(const void *a, const void *b){
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+/* An n x k matrix of uniform [0, 1) values */
+static Matrix* random_matrix(int n, int k){
+  Matrix *H = allocate_matrix(n, k);
+  Rng rng;
+  int i, j;
+  if (H == NULL){
+    return NULL;
+  }
+  rng_seed(&rng, BENCH_SEED);
+  for (i = 0; i < n; i++){
+    for (j = 0; j < k; j++){
+      MAT_ROW(H, i)[j] = rng_uniform(&rng);
+    }
+  }
+  return H;
+}
+
+/* Builds the untimed inputs of the named kernel, 0 on success */
+static int prepare(const char *kernel, BenchData *data){
+  Matrix *D;
+  if (strcmp(kernel, "matrix_mul") == 0){
+    data->A = calc_sym(data->X, NULL);
+    data->H = random_matrix(data->X->rows, data->k);
+    return (data->A != NULL && data->H != NULL) ? 0 : -1;
+  }
+  if (strcmp(kernel, "update_H") == 0){
+    data->W = calc_sym_packed(data->X, NULL);
+    D = calc_ddg_packed(data->W);
+    if (calc_norm_packed_in_place(data->W, D) != 0){
+      free_matrix(D);
+      return -1;
+    }
+    free_matrix(D);
+    data->H = initialize_H(data->W, data->k, BENCH_SEED);
+    data->H_next = allocate_matrix(data->X->rows, data->k);
+    data->workspace = allocate_symnmf_workspace(data->X->rows, data->k);
+    return (data->H != NULL && data->H_next != NULL && data->workspace != NULL) ? 0 : -1;
+  }
+  return 0;
+}
+
+static void release(BenchData *data){
+  free_matrix3(data->X, data->A, data->H);
+  free_matrix(data->H_next);
+  free_sym_matrix(data->W);
+  free_symnmf_workspace(data->workspace);
+}
+
+int main(int argc, char *argv[]) {
+  BenchData data;
+  BenchKernel run = NULL;
+  double times[MAX_REPEAT + 1], start;
+  int i = 1, t, threads = 0, repeat = DEFAULT_REPEAT;
+  if (argc > 2 && strcmp(argv[1], "exec") == 0) {
+    return exec_measured(argv + 2);
+  }
+  memset(&data, 0, sizeof(data));
+  data.k = DEFAULT_K;
+  while (i + 1 < argc && strncmp(argv[i], "--", 2) == 0) {
+    if (strcmp(argv[i], "--threads") == 0) {
+      threads = atoi(argv[i + 1]);
+    } else if (strcmp(argv[i], "--repeat") == 0) {
+      repeat = atoi(argv[i + 1]);
+    } else if (strcmp(argv[i], "--k") == 0) {
+      data.k = atoi(argv[i + 1]);
+    } else {
+      error_has_occured();
+    }
+    i += 2;
+  }
+  if (argc - i != 2 || repeat < 1 || repeat > MAX_REPEAT || data.k < 1) {
+    error_has_occured();
+  }
+  for (t = 0; t < KERNEL_COUNT; t++) {
+    if (strcmp(argv[i], kernels[t].name) == 0) {
+      run = kernels[t].run;
+    }
+  }
+  threadpool_init(threads);
+  data.X = file_to_matrix(argv[i + 1]);
+  if (run == NULL || data.X == NULL || data.k >= data.X->rows || prepare(argv[i], &data) != 0) {
+    release(&data);
+    error_has_occured();
+  }
+  for (t = 0; t <= repeat; t++) { /* run 0 warms up */
+    start = seconds_now();
+    if (run(&data) != 0) {
+      release(&data);
+      error_has_occured();
+    }
+    times[t] = seconds_now() - start;
+  }
+  qsort(times + 1, (size_t)repeat, sizeof(double), compare_doubles);
+  printf("{\"kernel\": \"%s\", \"n\": %d, \"d\": %d, \"k\": %d, \"threads\": %d, "
+         "\"repeat\": %d, \"best\": %.9g, \"median\": %.9g}\n",
+         argv[i], data.X->rows, data.X->cols, data.k, threadpool_size(), repeat,
+         times[1], times[1 + repeat / 2]);
+  release(&data);
+  threadpool_shutdown();
+  return 0;
+}
@@ -0,0 +1,186 @@
+import argparse
+import json
+import os
+import platform
+import subprocess
+import sys
+import numpy as np
+
+# Benchmark suite behind `make bench`.
+#
+#   python3 bench.py run [--sizes 1000,4000] [--dims 2,16,128] [--k 8] [--threads 0]
+#                        [--repeat 3] [--output bench_results.json]
+#   python3 bench.py compare baseline.json current.json [--threshold 0.10]
+#
+# run generates Gaussian blobs (cached under bench_data/), times each goal of ./symnmf and
+# each kernel of ./symnmf_bench on every (n, d) pair, and writes one record per measurement:
+# seconds (best of --repeat), GFLOP/s from the models in flop_count, and the peak resident
+# set size of the process. Sizes whose dense W would exceed --max-dense-gb run the goals on
+# the sparse --knn graph instead and skip the dense kernels. compare lists every record that
+# got slower than the threshold allows and exits with status 1 if there is any.
+
+DATA_DIR = "bench_data"
+GOALS = ["sym", "ddg", "norm", "symnmf"]
+KERNELS = ["matrix_mul", "calc_sym", "update_H"]
+PRESETS = {
+  "quick": ([1000, 2000, 4000], [2, 16, 128]),
+  "full": ([1000, 10000, 100000], [2, 16, 128, 512]),
+}
+SPARSE_NEIGHBORS = 10
+
+# Binary matrix files, same layout as utils.h (see also symnmf.py)
+BINARY_HEADER = np.dtype([("magic", "S4"), ("version", "u1"), ("dtype", "u1"), ("reserved", "<u2"),
+                          ("rows", "<u8"), ("cols", "<u8"), ("reserved2", "<u8")])
+
+
+def write_binary(file_name, mat):
+  header = np.zeros(1, dtype=BINARY_HEADER)
+  header["magic"], header["version"], header["dtype"] = b"SNMF", 1, 1
+  header["rows"], header["cols"] = mat.shape
+  with open(file_name, "wb") as f:
+    f.write(header.tobytes())
+    f.write(np.ascontiguousarray(mat, dtype="<f8").tobytes())
+
+
+def blobs_file(n, d, k):
+  # k Gaussian blobs, scaled with d so that affinities stay away from 0 in every dimension
+  file_name = os.path.join(DATA_DIR, "blobs_n%d_d%d_k%d.bin" % (n, d, k))
+  if not os.path.exists(file_name):
+    os.makedirs(DATA_DIR, exist_ok=True)
+    rng = np.random.default_rng(n * 1000003 + d * 101 + k)
+    centers = rng.normal(0, 3 / np.sqrt(d), (k, d))
+    labels = rng.integers(0, k, n)
+    write_binary(file_name, centers[labels] + rng.normal(0, 1 / np.sqrt(d), (n, d)))
+  return file_name
+
+
+def flop_count(name, n, d, k):
+  # floating point operations of one run; None where it depends on the data (iterations)
+  pairs = n * (n - 1) / 2
+  distances = 3 * d * pairs  # subtract, multiply, add per coordinate and pair
+  return {
+    "sym": distances,
+    "calc_sym": distances,
+    "ddg": distances + n * n,  # + row sums
+    "norm": distances + 3 * n * n,  # + row sums and the two-sided scaling
+    "matrix_mul": 2 * n * n * k,
+    "update_H": 2 * n * n * k + 4 * n * k * k + 5 * n * k,  # W H, H^T H, H (H^T H), update
+  }.get(name)
+
+
+def run_process(command, capture):
+  # runs command under `symnmf_bench exec`, returns (seconds, peak RSS in MB, stdout)
+  process = subprocess.run(["./symnmf_bench", "exec"] + command, stderr=subprocess.PIPE,
+                           stdout=subprocess.PIPE if capture else subprocess.DEVNULL)
+  if process.returncode != 0:
+    raise RuntimeError("%s failed with status %d" % (" ".join(command), process.returncode))
+  usage = json.loads(process.stderr.decode().strip().splitlines()[-1])
+  return usage["seconds"], usage["peak_rss_kb"] / 1024, process.stdout
+
+
+def record(kind, name, n, d, k, threads, graph, seconds, rss):
+  flops = flop_count(name, n, d, k) if graph == "dense" else None
+  return {"kind": kind, "name": name, "n": n, "d": d, "k": k, "threads": threads, "graph": graph,
+          "seconds": seconds, "gflops": flops / seconds / 1e9 if flops else None,
+          "peak_rss_mb": round(rss, 1)}
+
+
+def bench_goal(goal, file_name, n, d, args, dense):
+  command = ["./symnmf", "--format", "binary", "--k", str(args.k)]
+  if args.threads > 0:
+    command += ["--threads", str(args.threads)]
+  if not dense:
+    command += ["--knn", str(SPARSE_NEIGHBORS)]
+  runs = [run_process(command + [goal, file_name], False) for _ in range(args.repeat)]
+  graph = "dense" if dense else "knn%d" % SPARSE_NEIGHBORS
+  return record("goal", goal, n, d, args.k, args.threads, graph,
+                min(r[0] for r in runs), max(r[1] for r in runs))
+
+
+def bench_kernel(kernel, file_name, n, d, args):
+  command = ["./symnmf_bench", "--repeat", str(args.repeat), "--k", str(args.k)]
+  if args.threads > 0:
+    command += ["--threads", str(args.threads)]
+  _, rss, output = run_process(command + [kernel, file_name], True)
+  result = json.loads(output)
+  return record("kernel", kernel, n, d, args.k, args.threads, "dense", result["best"], rss)
+
+
+def run(args):
+  sizes, dims = PRESETS[args.preset]
+  sizes = [int(s) for s in args.sizes.split(",")] if args.sizes else sizes
+  dims = [int(s) for s in args.dims.split(",")] if args.dims else dims
+  results = []
+  for n in sizes:
+    dense = n * n * 8 / 2**30 <= args.max_dense_gb
+    for d in dims:
+      file_name = blobs_file(n, d, args.k)
+      for goal in GOALS:
+        results.append(bench_goal(goal, file_name, n, d, args, dense))
+        print_record(results[-1])
+      for kernel in KERNELS if dense else []:
+        results.append(bench_kernel(kernel, file_name, n, d, args))
+        print_record(results[-1])
+  machine = {"platform": platform.platform(), "processor": platform.processor(),
+             "cpus": os.cpu_count()}
+  with open(args.output, "w") as f:
+    json.dump({"machine": machine, "results": results}, f, indent=1)
+  return 0
+
+
+def print_record(r):
+  gflops = "%8.2f" % r["gflops"] if r["gflops"] else "       -"
+  print("%-6s %-10s n=%-6d d=%-4d %-6s %9.4f s %s GFLOP/s %9.1f MB" %
+        (r["kind"], r["name"], r["n"], r["d"], r["graph"], r["seconds"], gflops, r["peak_rss_mb"]))
+  sys.stdout.flush()
+
+
+def key(r):
+  return (r["kind"], r["name"], r["n"], r["d"], r["k"], r["threads"], r["graph"])
+
+
+def compare(args):
+  with open(args.baseline) as f:
+    baseline = {key(r): r for r in json.load(f)["results"]}
+  with open(args.current) as f:
+    current = json.load(f)["results"]
+  slower = 0
+  for r in current:
+    base = baseline.get(key(r))
+    if base is None:
+      continue
+    change = r["seconds"] / base["seconds"] - 1
+    flag = "SLOWER" if change > args.threshold else ""
+    slower += flag != ""
+    print("%-6s %-10s n=%-6d d=%-4d %-6s %9.4f s -> %9.4f s %+7.1f%% %s" %
+          (r["kind"], r["name"], r["n"], r["d"], r["graph"], base["seconds"], r["seconds"],
+           100 * change, flag))
+  print("%d of %d measurements slower than the baseline by more than %.0f%%" %
+        (slower, len(current), 100 * args.threshold))
+  return 1 if slower else 0
+
+
+def main():
+  parser = argparse.ArgumentParser(description="SymNMF benchmark suite")
+  commands = parser.add_subparsers(dest="command", required=True)
+  run_parser = commands.add_parser("run", help="run the benchmarks")
+  run_parser.add_argument("--preset", choices=sorted(PRESETS), default="quick")
+  run_parser.add_argument("--sizes", help="comma separated point counts, overrides the preset")
+  run_parser.add_argument("--dims", help="comma separated dimensions, overrides the preset")
+  run_parser.add_argument("--k", type=int, default=8, help="blobs, and clusters for symnmf")
+  run_parser.add_argument("--threads", type=int, default=0, help="0: SYMNMF_THREADS or all CPUs")
+  run_parser.add_argument("--repeat", type=int, default=3)
+  run_parser.add_argument("--max-dense-gb", type=float, default=4.0,
+                          help="largest dense n x n matrix to benchmark; larger sizes use --knn")
+  run_parser.add_argument("--output", default="bench_results.json")
+  compare_parser = commands.add_parser("compare", help="flag slowdowns against a baseline")
+  compare_parser.add_argument("baseline")
+  compare_parser.add_argument("current")
+  compare_parser.add_argument("--threshold", type=float, default=0.10,
+                              help="relative slowdown that counts as a regression")
+  args = parser.parse_args()
+  sys.exit(run(args) if args.command == "run" else compare(args))
+
+
+if __name__ == "__main__":
+  main()
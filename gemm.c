@@ -0,0 +1,268 @@
+/**
+ * Blocked GEMM in the usual three-level layout: B is packed into KC x NC panels of NR-wide
+ * column slivers, A into MC x KC blocks of MR-tall row slivers, and a micro-kernel multiplies
+ * one MR x KC sliver by one KC x NR sliver while the MR x NR block of C stays in registers.
+ * The micro-kernel itself is the instruction-set specific one from simd.c.
+ * Row blocks of C are spread over the thread pool; each element of C is still summed over k
+ * in the same order, so results do not depend on the number of threads.
+ * Packing also resolves transposition, so all four op(A)/op(B) combinations share one kernel.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "gemm.h"
+#include "mat_utils.h"
+#include "simd.h"
+#include "threadpool.h"
+
+/* Copies the mc x kc block of op(A) starting at (row, col) into MR-tall slivers, zero padded */
+static void pack_A(int mc, int kc, const double *A, int lda, int trans_A,
+                   int row, int col, double *packed){
+  int ir, p, r, m_r;
+  const double *src;
+  for (ir = 0; ir < mc; ir += GEMM_MR) {
+    m_r = (mc - ir < GEMM_MR) ? mc - ir : GEMM_MR;
+    for (p = 0; p < kc; p++) {
+      for (r = 0; r < m_r; r++) {
+        if (trans_A) {
+          src = A + (size_t)(col + p) * lda + (row + ir + r);
+        } else {
+          src = A + (size_t)(row + ir + r) * lda + (col + p);
+        }
+        packed[r] = *src;
+      }
+      for (; r < GEMM_MR; r++) {
+        packed[r] = 0.0;
+      }
+      packed += GEMM_MR;
+    }
+  }
+}
+
+/* Copies the kc x nc block of op(B) starting at (row, col) into NR-wide slivers, zero padded */
+static void pack_B(int kc, int nc, const double *B, int ldb, int trans_B,
+                   int row, int col, double *packed){
+  int jr, p, c, n_r;
+  const double *src;
+  for (jr = 0; jr < nc; jr += GEMM_NR) {
+    n_r = (nc - jr < GEMM_NR) ? nc - jr : GEMM_NR;
+    for (p = 0; p < kc; p++) {
+      if (!trans_B) {
+        src = B + (size_t)(row + p) * ldb + (col + jr);
+        for (c = 0; c < n_r; c++) {
+          packed[c] = src[c];
+        }
+      } else {
+        for (c = 0; c < n_r; c++) {
+          packed[c] = B[(size_t)(col + jr + c) * ldb + (row + p)];
+        }
+      }
+      for (; c < GEMM_NR; c++) {
+        packed[c] = 0.0;
+      }
+      packed += GEMM_NR;
+    }
+  }
+}
+
+typedef struct {
+    int m, k, nc, kc, jc, pc;
+    const double *A;
+    int lda, trans_A;
+    const double *B;
+    int ldb, trans_B;
+    double *C;
+    int ldc;
+    double *b_packed;
+    double **a_packed; /* one MC x KC buffer per worker */
+    const SimdKernels *kernels;
+} GemmJob;
+
+/* Packs the NR-wide slivers [begin, end) of the current B panel */
+static void pack_B_task(void *context, int begin, int end, int worker){
+  GemmJob *job = (GemmJob *)context;
+  int first = begin * GEMM_NR, width = end * GEMM_NR;
+  (void)worker;
+  if (width > job->nc) {
+    width = job->nc;
+  }
+  pack_B(job->kc, width - first, job->B, job->ldb, job->trans_B,
+         job->pc, job->jc + first, job->b_packed + (size_t)first * job->kc);
+}
+
+/* Multiplies the MC-tall row blocks [begin, end) of op(A) by the packed B panel */
+static void row_blocks_task(void *context, int begin, int end, int worker){
+  GemmJob *job = (GemmJob *)context;
+  double *a_packed = job->a_packed[worker];
+  int block, ic, mc, jr, ir, kc = job->kc, nc = job->nc;
+  for (block = begin; block < end; block++) {
+    ic = block * GEMM_MC;
+    mc = (job->m - ic < GEMM_MC) ? job->m - ic : GEMM_MC;
+    pack_A(mc, kc, job->A, job->lda, job->trans_A, ic, job->pc, a_packed);
+    for (jr = 0; jr < nc; jr += GEMM_NR) {
+      for (ir = 0; ir < mc; ir += GEMM_MR) {
+        job->kernels->gemm_kernel(kc, a_packed + (size_t)ir * kc, job->b_packed + (size_t)jr * kc,
+                                  job->C + (size_t)(ic + ir) * job->ldc + (job->jc + jr), job->ldc,
+                                  (mc - ir < GEMM_MR) ? mc - ir : GEMM_MR,
+                                  (nc - jr < GEMM_NR) ? nc - jr : GEMM_NR);
+      }
+    }
+  }
+}
+
+/* Zeroes C and fills in the operands of job; 0 if there is nothing to multiply */
+static int start_job(GemmJob *job, int m, int n, int k,
+                     const double *A, int lda, int trans_A,
+                     const double *B, int ldb, int trans_B,
+                     double *C, int ldc){
+  int i;
+  for (i = 0; i < m; i++) {
+    memset(C + (size_t)i * ldc, 0, (size_t)n * sizeof(double));
+  }
+  job->m = m;
+  job->k = k;
+  job->A = A;
+  job->lda = lda;
+  job->trans_A = trans_A;
+  job->B = B;
+  job->ldb = ldb;
+  job->trans_B = trans_B;
+  job->C = C;
+  job->ldc = ldc;
+  job->kernels = simd_kernels();
+  return m != 0 && n != 0 && k != 0;
+}
+
+/* Runs the panel loops of job over the n columns, on the thread pool unless serial */
+static void run_panels(GemmJob *job, int n, int serial){
+  int slivers, blocks = (job->m + GEMM_MC - 1) / GEMM_MC;
+  for (job->jc = 0; job->jc < n; job->jc += GEMM_NC) {
+    job->nc = (n - job->jc < GEMM_NC) ? n - job->jc : GEMM_NC;
+    slivers = (job->nc + GEMM_NR - 1) / GEMM_NR;
+    for (job->pc = 0; job->pc < job->k; job->pc += GEMM_KC) {
+      job->kc = (job->k - job->pc < GEMM_KC) ? job->k - job->pc : GEMM_KC;
+      if (serial) {
+        pack_B_task(job, 0, slivers, 0);
+        row_blocks_task(job, 0, blocks, 0);
+      } else {
+        parallel_for(slivers, 64, pack_B_task, job);
+        parallel_for(blocks, 1, row_blocks_task, job);
+      }
+    }
+  }
+}
+
+int gemm(int m, int n, int k,
+         const double *A, int lda, int trans_A,
+         const double *B, int ldb, int trans_B,
+         double *C, int ldc){
+  GemmJob job;
+  int i, workers, status = 0;
+  void *b_block, **a_blocks;
+
+  if (!start_job(&job, m, n, k, A, lda, trans_A, B, ldb, trans_B, C, ldc)) {
+    return 0;
+  }
+  workers = threadpool_size();
+  a_blocks = (void **)calloc((size_t)workers, sizeof(void *));
+  job.a_packed = (double **)calloc((size_t)workers, sizeof(double *));
+  job.b_packed = allocate_aligned((size_t)GEMM_KC * (GEMM_NC + GEMM_NR) * sizeof(double), &b_block);
+  if (a_blocks == NULL || job.a_packed == NULL || job.b_packed == NULL) {
+    status = -1;
+  }
+  for (i = 0; status == 0 && i < workers; i++) {
+    job.a_packed[i] = allocate_aligned((size_t)GEMM_MC * GEMM_KC * sizeof(double), &a_blocks[i]);
+    if (job.a_packed[i] == NULL) {
+      status = -1;
+    }
+  }
+  if (status == 0) {
+    run_panels(&job, n, 0);
+  }
+
+  for (i = 0; a_blocks != NULL && i < workers; i++) {
+    free(a_blocks[i]);
+  }
+  free(a_blocks);
+  free(job.a_packed);
+  free(b_block);
+  return status;
+}
+
+size_t gemm_pack_size(int n, int k){
+  size_t nc = (size_t)((n < GEMM_NC) ? n : GEMM_NC), kc = (size_t)((k < GEMM_KC) ? k : GEMM_KC);
+  return kc * ((nc + GEMM_NR - 1) / GEMM_NR * GEMM_NR) + (size_t)GEMM_MC * kc;
+}
+
+void gemm_serial(int m, int n, int k,
+                 const double *A, int lda, int trans_A,
+                 const double *B, int ldb, int trans_B,
+                 double *C, int ldc, double *pack){
+  GemmJob job;
+  size_t nc = (size_t)((n < GEMM_NC) ? n : GEMM_NC), kc = (size_t)((k < GEMM_KC) ? k : GEMM_KC);
+  if (!start_job(&job, m, n, k, A, lda, trans_A, B, ldb, trans_B, C, ldc)) {
+    return;
+  }
+  job.b_packed = pack;
+  pack += kc * ((nc + GEMM_NR - 1) / GEMM_NR * GEMM_NR); /* the A block follows the B panel */
+  job.a_packed = &pack;
+  run_panels(&job, n, 1);
+}
+
+size_t gram_scratch_size(int n, int k){
+  size_t blocks = (size_t)(n + GRAM_BLOCK - 1) / GRAM_BLOCK;
+  return (blocks > 0 ? blocks : 1) * (size_t)k * (size_t)k;
+}
+
+typedef struct {
+    int n, k, ldh;
+    const double *H;
+    double *scratch;
+} GramJob;
+
+/* Upper triangle of the partial Gram matrix of each row block in [begin, end) */
+static void gram_blocks_task(void *context, int begin, int end, int worker){
+  GramJob *job = (GramJob *)context;
+  int block, i, p, q, last, k = job->k;
+  const double *h;
+  double *partial, h_p;
+  (void)worker;
+  for (block = begin; block < end; block++) {
+    partial = job->scratch + (size_t)block * k * k;
+    memset(partial, 0, (size_t)k * k * sizeof(double));
+    last = (block + 1) * GRAM_BLOCK;
+    if (last > job->n) {
+      last = job->n;
+    }
+    for (i = block * GRAM_BLOCK; i < last; i++) {
+      h = job->H + (size_t)i * job->ldh;
+      for (p = 0; p < k; p++) {
+        h_p = h[p];
+        for (q = p; q < k; q++) {
+          partial[p * k + q] += h_p * h[q];
+        }
+      }
+    }
+  }
+}
+
+void gram(int n, int k, const double *H, int ldh, double *G, int ldg, double *scratch){
+  GramJob job;
+  int blocks = (n + GRAM_BLOCK - 1) / GRAM_BLOCK, block, p, q;
+  double sum;
+  job.n = n;
+  job.k = k;
+  job.H = H;
+  job.ldh = ldh;
+  job.scratch = scratch;
+  parallel_for(blocks, 1, gram_blocks_task, &job);
+  for (p = 0; p < k; p++) {
+    for (q = p; q < k; q++) {
+      sum = 0.0;
+      for (block = 0; block < blocks; block++) {
+        sum += scratch[(size_t)block * k * k + p * k + q];
+      }
+      G[(size_t)p * ldg + q] = sum;
+      G[(size_t)q * ldg + p] = sum;
+    }
+  }
+}
@@ -0,0 +1,59 @@
+/**
+ * This header file declares the blocked general matrix multiplication (GEMM) kernel used by
+ * the matrix_mul family in mat_utils.c. Operands are raw row-major buffers with a leading
+ * dimension (row stride), and either operand may be read transposed.
+ */
+
+#ifndef GEMM_H
+#define GEMM_H
+
+#include <stddef.h>
+
+/* Register tile computed by one micro-kernel call (rows x cols of C) */
+#define GEMM_MR 4
+#define GEMM_NR 8
+
+/* Cache blocking: a KC x NR sliver of B stays in L1, an MC x KC block of A in L2,
+ * and a KC x NC panel of B in L3 */
+#define GEMM_KC 256
+#define GEMM_MC 128
+#define GEMM_NC 4096
+
+/**
+ * Computes C = op(A) * op(B) where op(A) is m x k and op(B) is k x n.
+ * op(X) is X when trans_X is 0 and X transposed otherwise; lda/ldb/ldc are row strides.
+ * C must not overlap A or B. Returns 0 on success and -1 if the packing buffers could not
+ * be allocated.
+ */
+int gemm(int m, int n, int k,
+         const double *A, int lda, int trans_A,
+         const double *B, int ldb, int trans_B,
+         double *C, int ldc);
+
+/* Number of doubles of packing space gemm_serial needs for n columns and inner dimension k */
+size_t gemm_pack_size(int n, int k);
+
+/**
+ * Same as gemm on the calling thread only, packing into the caller's buffer `pack` of
+ * gemm_pack_size(n, k) doubles (aligned like allocate_aligned); for callers that already
+ * run on the thread pool and multiply many small tiles, so nothing is allocated per call.
+ */
+void gemm_serial(int m, int n, int k,
+                 const double *A, int lda, int trans_A,
+                 const double *B, int ldb, int trans_B,
+                 double *C, int ldc, double *pack);
+
+/* Rows of H accumulated into one partial Gram matrix before the partials are combined */
+#define GRAM_BLOCK 256
+
+/* Number of doubles of scratch gram() needs for an n x k input */
+size_t gram_scratch_size(int n, int k);
+
+/**
+ * Computes the k x k Gram matrix G = H^T * H of the n x k matrix H (row stride ldh).
+ * Fixed GRAM_BLOCK-row partial sums are combined in block order, so the result does not
+ * depend on the number of threads. `scratch` must hold gram_scratch_size(n, k) doubles.
+ */
+void gram(int n, int k, const double *H, int ldh, double *G, int ldg, double *scratch);
+
+#endif
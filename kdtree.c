@@ -0,0 +1,306 @@
+/**
+ * k-d tree construction and queries. Points are split at the median of the widest dimension
+ * of their bounding box until at most KDTREE_LEAF_SIZE remain. Distances are computed exactly
+ * as in the brute-force search, and a subtree is only pruned when its box is farther than the
+ * search radius by more than rounding could explain, so both searches return the same points.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "kdtree.h"
+#include "simd.h"
+
+#define PRUNE_SLACK 1e-12 /* relative margin before a box counts as out of range */
+
+/* 1 if candidate (d, j) is farther than (e, l); ties go to the larger index */
+static int farther(double d, int j, double e, int l){
+  return d > e || (d == e && j > l);
+}
+
+static void swap_entries(int *index, double *distance, int a, int b){
+  int swap_index = index[a];
+  double swap_distance = distance[a];
+  index[a] = index[b];
+  distance[a] = distance[b];
+  index[b] = swap_index;
+  distance[b] = swap_distance;
+}
+
+int heap_offer(int *index, double *distance, int count, int k, int j, double d){
+  int t, child, parent;
+  if (count < k) { /* sift the new entry up */
+    t = count++;
+    index[t] = j;
+    distance[t] = d;
+    while (t > 0) {
+      parent = (t - 1) / 2;
+      if (!farther(distance[t], index[t], distance[parent], index[parent])) {
+        break;
+      }
+      swap_entries(index, distance, t, parent);
+      t = parent;
+    }
+    return count;
+  }
+  if (k == 0 || !farther(distance[0], index[0], d, j)) {
+    return count;
+  }
+  index[0] = j; /* replace the farthest and sift it down */
+  distance[0] = d;
+  t = 0;
+  for (;;) {
+    child = 2 * t + 1;
+    if (child >= count) {
+      break;
+    }
+    if (child + 1 < count && farther(distance[child + 1], index[child + 1], distance[child], index[child])) {
+      child++;
+    }
+    if (!farther(distance[child], index[child], distance[t], index[t])) {
+      break;
+    }
+    swap_entries(index, distance, t, child);
+    t = child;
+  }
+  return count;
+}
+
+/* Bounding box of order[begin .. end - 1], written to low[] and high[] */
+static void node_bounds(const KdTree *tree, int begin, int end, double *low, double *high){
+  const double *row;
+  int t, c, d = tree->X->cols;
+  row = MAT_ROW(tree->X, tree->order[begin]);
+  memcpy(low, row, (size_t)d * sizeof(double));
+  memcpy(high, row, (size_t)d * sizeof(double));
+  for (t = begin + 1; t < end; t++) {
+    row = MAT_ROW(tree->X, tree->order[t]);
+    for (c = 0; c < d; c++) {
+      if (row[c] < low[c]) {
+        low[c] = row[c];
+      }
+      if (row[c] > high[c]) {
+        high[c] = row[c];
+      }
+    }
+  }
+}
+
+/* 1 if point a comes before point b along dimension c (ties by index) */
+static int before(const Matrix *X, int c, int a, int b){
+  double x = MAT_ROW(X, a)[c], y = MAT_ROW(X, b)[c];
+  return x < y || (x == y && a < b);
+}
+
+/* Rearranges order[begin .. end - 1] so position middle holds its median along dimension c */
+static void select_median(const Matrix *X, int *order, int begin, int end, int middle, int c){
+  int low = begin, high = end - 1, i, j, pivot, swap;
+  while (low < high) {
+    pivot = order[low + (high - low) / 2];
+    i = low;
+    j = high;
+    while (i <= j) {
+      while (before(X, c, order[i], pivot)) {
+        i++;
+      }
+      while (before(X, c, pivot, order[j])) {
+        j--;
+      }
+      if (i <= j) {
+        swap = order[i];
+        order[i++] = order[j];
+        order[j--] = swap;
+      }
+    }
+    if (middle <= j) {
+      high = j;
+    } else if (middle >= i) {
+      low = i;
+    } else {
+      return;
+    }
+  }
+}
+
+/* Builds the subtree over order[begin .. end - 1] and returns its node index */
+static int build_node(KdTree *tree, int begin, int end){
+  int node = tree->node_count++, d = tree->X->cols, c, widest = 0, middle;
+  double *low = tree->bounds + (size_t)node * 2 * (size_t)d, *high = low + d;
+  tree->nodes[node].begin = begin;
+  tree->nodes[node].end = end;
+  tree->nodes[node].left = -1;
+  tree->nodes[node].right = -1;
+  node_bounds(tree, begin, end, low, high);
+  if (end - begin <= KDTREE_LEAF_SIZE) {
+    return node;
+  }
+  for (c = 1; c < d; c++) {
+    if (high[c] - low[c] > high[widest] - low[widest]) {
+      widest = c;
+    }
+  }
+  middle = begin + (end - begin) / 2;
+  select_median(tree->X, tree->order, begin, end, middle, widest);
+  tree->nodes[node].left = build_node(tree, begin, middle);
+  tree->nodes[node].right = build_node(tree, middle, end);
+  return node;
+}
+
+KdTree* build_kdtree(Matrix *X){
+  KdTree *tree;
+  size_t capacity;
+  int i;
+  if (X == NULL || X->rows < 1 || X->cols < 1) {
+    return NULL;
+  }
+  /* median splits leave at least KDTREE_LEAF_SIZE / 2 points per leaf */
+  capacity = 4 * ((size_t)X->rows / KDTREE_LEAF_SIZE + 1);
+  tree = (KdTree *)calloc(1, sizeof(KdTree));
+  if (tree == NULL) {
+    return NULL;
+  }
+  tree->X = X;
+  tree->order = (int *)malloc((size_t)X->rows * sizeof(int));
+  tree->nodes = (KdNode *)malloc(capacity * sizeof(KdNode));
+  tree->bounds = (double *)malloc(capacity * 2 * (size_t)X->cols * sizeof(double));
+  if (tree->order == NULL || tree->nodes == NULL || tree->bounds == NULL) {
+    free_kdtree(tree);
+    return NULL;
+  }
+  for (i = 0; i < X->rows; i++) {
+    tree->order[i] = i;
+  }
+  build_node(tree, 0, X->rows);
+  return tree;
+}
+
+void free_kdtree(KdTree *tree){
+  if (tree != NULL) {
+    free(tree->order);
+    free(tree->nodes);
+    free(tree->bounds);
+    free(tree);
+  }
+}
+
+/* Squared distance from point x to the bounding box of node */
+static double box_distance(const KdTree *tree, int node, const double *x){
+  int c, d = tree->X->cols;
+  const double *low = tree->bounds + (size_t)node * 2 * (size_t)d, *high = low + d;
+  double sum = 0.0, gap;
+  for (c = 0; c < d; c++) {
+    gap = (x[c] < low[c]) ? low[c] - x[c] : (x[c] > high[c]) ? x[c] - high[c] : 0.0;
+    sum += gap * gap;
+  }
+  return sum;
+}
+
+/* 1 if nothing in a box at squared distance box can be within radius */
+static int out_of_range(double box, double radius){
+  return box > radius * (1 + PRUNE_SLACK);
+}
+
+typedef struct {
+    const KdTree *tree;
+    const SimdKernels *kernels;
+    const double *x;
+    int self;
+    int k;
+    int count;
+    int *index;
+    double *distance;
+} KnnSearch;
+
+static void knn_node(KnnSearch *search, int node){
+  const KdTree *tree = search->tree;
+  const KdNode *n = &tree->nodes[node];
+  int t, j, near, far;
+  double d, near_box, far_box;
+  if (n->left < 0) {
+    for (t = n->begin; t < n->end; t++) {
+      j = tree->order[t];
+      if (j != search->self) {
+        d = search->kernels->squared_distance(search->x, MAT_ROW(tree->X, j), (size_t)tree->X->cols);
+        search->count = heap_offer(search->index, search->distance, search->count, search->k, j, d);
+      }
+    }
+    return;
+  }
+  near = n->left;
+  far = n->right;
+  near_box = box_distance(tree, near, search->x);
+  far_box = box_distance(tree, far, search->x);
+  if (far_box < near_box) {
+    near = n->right;
+    far = n->left;
+    d = near_box;
+    near_box = far_box;
+    far_box = d;
+  }
+  if (search->count < search->k || !out_of_range(near_box, search->distance[0])) {
+    knn_node(search, near);
+  }
+  if (search->count < search->k || !out_of_range(far_box, search->distance[0])) {
+    knn_node(search, far);
+  }
+}
+
+int kdtree_knn(const KdTree *tree, int self, int k, int *index, double *distance){
+  KnnSearch search;
+  search.tree = tree;
+  search.kernels = simd_kernels();
+  search.x = MAT_ROW(tree->X, self);
+  search.self = self;
+  search.k = k;
+  search.count = 0;
+  search.index = index;
+  search.distance = distance;
+  if (k > 0) {
+    knn_node(&search, 0);
+  }
+  return search.count;
+}
+
+typedef struct {
+    const KdTree *tree;
+    const SimdKernels *kernels;
+    const double *x;
+    int self;
+    double radius;
+    NeighborVisitor visit;
+    void *context;
+} RadiusSearch;
+
+static void radius_node(RadiusSearch *search, int node){
+  const KdTree *tree = search->tree;
+  const KdNode *n = &tree->nodes[node];
+  int t, j;
+  double d;
+  if (out_of_range(box_distance(tree, node, search->x), search->radius)) {
+    return;
+  }
+  if (n->left >= 0) {
+    radius_node(search, n->left);
+    radius_node(search, n->right);
+    return;
+  }
+  for (t = n->begin; t < n->end; t++) {
+    j = tree->order[t];
+    if (j != search->self) {
+      d = search->kernels->squared_distance(search->x, MAT_ROW(tree->X, j), (size_t)tree->X->cols);
+      if (d <= search->radius) {
+        search->visit(search->context, j, d);
+      }
+    }
+  }
+}
+
+void kdtree_radius(const KdTree *tree, int self, double radius, NeighborVisitor visit, void *context){
+  RadiusSearch search;
+  search.tree = tree;
+  search.kernels = simd_kernels();
+  search.x = MAT_ROW(tree->X, self);
+  search.self = self;
+  search.radius = radius;
+  search.visit = visit;
+  search.context = context;
+  radius_node(&search, 0);
+}
@@ -0,0 +1,53 @@
+/**
+ * This header file declares a k-d tree over the rows of a matrix, answering k-nearest-neighbor
+ * and radius queries for the points themselves. Nodes keep the bounding box of their points,
+ * so whole subtrees are skipped when the box is farther than the current search radius; in
+ * low dimensions a query then only looks at O(log n + k) points instead of all n.
+ */
+
+#ifndef KDTREE_H
+#define KDTREE_H
+
+#include "mat_utils.h"
+
+#define KDTREE_LEAF_SIZE 16 /* a node with more points than this is split */
+#define KDTREE_MAX_DIMS 16 /* above this, pruning rarely pays and brute force is used instead */
+
+typedef struct {
+    int begin; /* the node's points are order[begin .. end - 1] */
+    int end;
+    int left; /* child nodes, -1 for a leaf */
+    int right;
+} KdNode;
+
+typedef struct {
+    Matrix *X; /* not owned, must outlive the tree */
+    int *order; /* permutation of the rows, grouped by node */
+    KdNode *nodes;
+    double *bounds; /* per node: the low corner, then the high corner (2 * X->cols values) */
+    int node_count;
+} KdTree;
+
+/* Called by kdtree_radius for every point j at squared distance d within the radius */
+typedef void (*NeighborVisitor)(void *context, int j, double d);
+
+KdTree* build_kdtree(Matrix *X); /* NULL on error */
+void free_kdtree(KdTree *tree);
+
+/**
+ * The (at most) k points nearest to point `self`, itself excluded, ties going to the lower
+ * index: exactly the set a brute-force scan keeps. Writes them, as a max-heap on distance,
+ * to index/distance and returns how many were found.
+ */
+int kdtree_knn(const KdTree *tree, int self, int k, int *index, double *distance);
+
+/* Visits every point other than `self` whose squared distance to it is at most radius */
+void kdtree_radius(const KdTree *tree, int self, double radius, NeighborVisitor visit, void *context);
+
+/**
+ * Offers candidate (j, d) to a max-heap holding the k nearest points seen so far (count of
+ * them filled) and returns the new count. Shared with the brute-force search.
+ */
+int heap_offer(int *index, double *distance, int count, int k, int j, double d);
+
+#endif
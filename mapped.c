@@ -0,0 +1,89 @@
+/**
+ * POSIX implementation of the mapping helpers declared in mapped.h.
+ * Files are sized with ftruncate, which leaves them sparse: pages are only allocated on
+ * disk when first written, so mapping an n x n output costs nothing until it is filled.
+ */
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "mapped.h"
+
+#define SCRATCH_TEMPLATE "symnmf-scratch-XXXXXX"
+
+/* Maps size bytes of the open file fd and closes fd */
+static void* map_descriptor(int fd, size_t size, int prot, int flags){
+  void *base;
+  if (size == 0) {
+    size = 1; /* mmap rejects empty mappings */
+  }
+  base = mmap(NULL, size, prot, flags, fd, 0);
+  close(fd);
+  return (base == MAP_FAILED) ? NULL : base;
+}
+
+void* map_scratch(size_t size, const char *dir){
+  char *path;
+  int fd;
+  if (dir == NULL) {
+    dir = getenv(SCRATCH_ENV);
+  }
+  if (dir == NULL || *dir == '\0') {
+    dir = ".";
+  }
+  path = (char *)malloc(strlen(dir) + sizeof(SCRATCH_TEMPLATE) + 1);
+  if (path == NULL) {
+    return NULL;
+  }
+  sprintf(path, "%s/%s", dir, SCRATCH_TEMPLATE);
+  fd = mkstemp(path);
+  if (fd >= 0) {
+    unlink(path); /* the space is reclaimed as soon as the mapping goes away */
+  }
+  free(path);
+  if (fd < 0 || ftruncate(fd, (off_t)(size > 0 ? size : 1)) != 0) {
+    if (fd >= 0) {
+      close(fd);
+    }
+    return NULL;
+  }
+  return map_descriptor(fd, size, PROT_READ | PROT_WRITE, MAP_SHARED);
+}
+
+void* map_new_file(const char *path, size_t size){
+  int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    return NULL;
+  }
+  if (ftruncate(fd, (off_t)size) != 0) {
+    close(fd);
+    return NULL;
+  }
+  return map_descriptor(fd, size, PROT_READ | PROT_WRITE, MAP_SHARED);
+}
+
+void* map_existing_file(const char *path, size_t *size){
+  struct stat info;
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return NULL;
+  }
+  if (fstat(fd, &info) != 0 || info.st_size <= 0) {
+    close(fd);
+    return NULL;
+  }
+  *size = (size_t)info.st_size;
+  return map_descriptor(fd, *size, PROT_READ | PROT_WRITE, MAP_PRIVATE);
+}
+
+int sync_mapping(void *base, size_t size){
+  return (msync(base, (size > 0) ? size : 1, MS_SYNC) == 0) ? 0 : -1;
+}
+
+int unmap_buffer(void *base, size_t size){
+  return (munmap(base, (size > 0) ? size : 1) == 0) ? 0 : -1;
+}
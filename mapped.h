@@ -0,0 +1,43 @@
+/**
+ * This header file declares helpers for file-backed memory mappings. They let matrices live
+ * in the page cache instead of the heap, so problems larger than RAM can still run, with
+ * the kernel paging data to and from local disk as needed.
+ */
+
+#ifndef MAPPED_H
+#define MAPPED_H
+
+#include <stddef.h>
+
+/* Environment variable naming the default directory for scratch mappings */
+#define SCRATCH_ENV "SYMNMF_SCRATCH"
+
+/**
+ * Maps size zero-filled bytes backed by an unlinked temporary file in dir (SYMNMF_SCRATCH,
+ * then the current directory, if dir is NULL). Returns the mapping, or NULL on failure.
+ */
+void* map_scratch(size_t size, const char *dir);
+
+/**
+ * Creates (or truncates) the file at path with size bytes, zero-filled, and maps it shared
+ * and writable so stores go to the file. Returns the mapping, or NULL on failure.
+ */
+void* map_new_file(const char *path, size_t size);
+
+/**
+ * Maps an existing file copy-on-write: the caller may modify the data without changing
+ * the file. The file size is stored in *size. Returns the mapping, or NULL on failure.
+ */
+void* map_existing_file(const char *path, size_t *size);
+
+/* Writes the dirty pages of a shared mapping back to its file and waits; returns 0 on success */
+int sync_mapping(void *base, size_t size);
+
+/**
+ * Unmaps a mapping; returns 0 on success. Dirty pages of a shared file mapping still reach
+ * the file, but in the background: sync_mapping first when the caller needs to know they did.
+ * Scratch mappings never need that, their file is already unlinked.
+ */
+int unmap_buffer(void *base, size_t size);
+
+#endif
@@ -3,22 +3,35 @@
 #include <math.h>
 #include <string.h>
 #include "mat_utils.h"
+#include "gemm.h"
+#include "utils.h"
+#include "mapped.h"
+#include "profile.h"
 
-/* free matrix rows from 0 to (row-1) */
-void free_to_row(Matrix* X, int row){
-  int i;
-  for (i = 0; i < row; i++){
-    free((X->cords)[i]);
+int release_block(void *block, size_t mapped){
+  if (mapped > 0){
+    return unmap_buffer(block, mapped);
   }
-  free(X->cords);
-  free(X);
+  free(block);
+  return 0;
 }
 
-void free_matrix(Matrix *A){
+int release_matrix(Matrix *A){
+  int status = 0;
   if (A != NULL){
-    free_to_row(A, A->rows); /* frees matrix to the last row */
+    if (A->block != NULL && A->mapped == 0){
+      profile_allocation(-(double)A->rows * (double)A->stride * sizeof(double));
+    }
+    status = release_block(A->block, A->mapped);
+    free(A->cords);
+    free(A);
   }
-} 
+  return status;
+}
+
+void free_matrix(Matrix *A){
+  release_matrix(A);
+}
 
 void free_matrix2(Matrix *A, Matrix *B){
   free_matrix(A);
@@ -30,49 +43,157 @@ void free_matrix3(Matrix *A, Matrix *B, Matrix *C){
   free_matrix2(B, C);
 }
 
-Matrix* allocate_matrix(int rows, int cols){
+/* Allocates size bytes aligned to MATRIX_ALIGNMENT, the raw block is returned through block */
+void* allocate_aligned(size_t size, void **block){
+  size_t address;
+  *block = malloc(size + MATRIX_ALIGNMENT);
+  if (*block == NULL){
+    return NULL;
+  }
+  address = (size_t)(*block);
+  address = (address + MATRIX_ALIGNMENT - 1) & ~(size_t)(MATRIX_ALIGNMENT - 1);
+  return (void*)address;
+}
+
+/* Builds the row-pointer view over data; on failure the caller keeps ownership of block */
+Matrix* matrix_from_buffer(int rows, int cols, double *data, void *block){
   int i;
-  Matrix* result = (Matrix *)malloc(sizeof(Matrix));
+  Matrix* result;
+  if (rows < 0 || cols < 0 || data == NULL){
+    return NULL;
+  }
+  result = (Matrix *)malloc(sizeof(Matrix));
   if (result == NULL)
   {
       return NULL;
   }
   result->rows = rows;
   result->cols = cols;
-  result->cords = (double**)malloc(rows*sizeof(double*));
+  result->stride = cols;
+  result->data = data;
+  result->cords = (double**)malloc((rows > 0 ? rows : 1)*sizeof(double*));
   if (result->cords == NULL){
     free(result);
     return NULL;
   }
   for (i = 0; i < rows; i++){
-    (result->cords)[i] = (double*)malloc(cols*sizeof(double));
-    if ((result->cords)[i] == NULL){
-      free_to_row(result, i);
-    }
+    (result->cords)[i] = MAT_ROW(result, i);
   }
-  return result; 
+  result->block = block;
+  result->mapped = 0;
+  return result;
 }
 
-Matrix* matrix_mul(Matrix* A, Matrix* B){
-  int i, j, k;
+Matrix* allocate_matrix(int rows, int cols){
+  size_t count;
+  void *block;
+  double *data;
+  Matrix* result;
+  if (rows < 0 || cols < 0){
+    return NULL;
+  }
+  count = (size_t)rows * (size_t)cols;
+  if (cols != 0 && count / (size_t)cols != (size_t)rows){
+    return NULL; /* Error: size overflow */
+  }
+  if (count > ((size_t)-1 - MATRIX_ALIGNMENT) / sizeof(double)){
+    return NULL;
+  }
+  data = (double*)allocate_aligned((count > 0 ? count : 1)*sizeof(double), &block);
+  if (data == NULL){
+    return NULL;
+  }
+  memset(data, 0, count*sizeof(double));
+  result = matrix_from_buffer(rows, cols, data, block);
+  if (result == NULL){
+    free(block);
+    return NULL;
+  }
+  profile_allocation((double)count * sizeof(double));
+  return result;
+}
+
+/**
+ * Same as allocate_matrix, but the elements live in a mapping of an unlinked scratch file
+ * in dir (see map_scratch), so the kernel can page them out to disk instead of failing
+ * when the matrix does not fit in memory. The file is sparse, so its pages read as zero.
+ */
+Matrix* allocate_matrix_mapped(int rows, int cols, const char *dir){
+  size_t count, size;
+  void *block;
+  Matrix* result;
+  if (rows < 0 || cols < 0){
+    return NULL;
+  }
+  count = (size_t)rows * (size_t)cols;
+  if (cols != 0 && count / (size_t)cols != (size_t)rows){
+    return NULL; /* Error: size overflow */
+  }
+  if (count > (size_t)-1 / sizeof(double)){
+    return NULL;
+  }
+  size = count * sizeof(double);
+  block = map_scratch(size, dir);
+  if (block == NULL){
+    return NULL;
+  }
+  result = matrix_from_buffer(rows, cols, (double *)block, block);
+  if (result == NULL){
+    unmap_buffer(block, size);
+    return NULL;
+  }
+  result->mapped = (size > 0) ? size : 1;
+  return result;
+}
+
+int matrix_mul_into(Matrix* C, Matrix* A, Matrix* B, int transpose_A, int transpose_B){
+  int m, n, k, b_rows;
+  if (A == NULL || B == NULL || C == NULL) {
+    return -1;
+  }
+  m = transpose_A ? A->cols : A->rows;
+  k = transpose_A ? A->rows : A->cols;
+  b_rows = transpose_B ? B->cols : B->rows;
+  n = transpose_B ? B->rows : B->cols;
+  if (k != b_rows || C->rows != m || C->cols != n || C == A || C == B) {
+    return -1; /* Error: matrices cannot be multiplied */
+  }
+  profile_product(PRODUCT_DENSE, 2.0 * m * n * k,
+                  ((double)m * k + (double)k * n + (double)m * n) * sizeof(double));
+  return gemm(m, n, k, A->data, A->stride, transpose_A,
+              B->data, B->stride, transpose_B, C->data, C->stride);
+}
+
+Matrix* matrix_mul_transposed(Matrix* A, Matrix* B, int transpose_A, int transpose_B){
   Matrix* result;
-  if (A == NULL || B == NULL || A->cols != B->rows) {
-    return NULL; /* Error: matrices cannot be multiplied */
+  if (A == NULL || B == NULL) {
+    return NULL;
   }
-  result = allocate_matrix(A->rows, B->cols);
+  result = allocate_matrix(transpose_A ? A->cols : A->rows, transpose_B ? B->rows : B->cols);
   if (result == NULL) {
     return NULL; /* Error: memory allocation failed */
   }
-  for (i = 0; i < A->rows; i++) {
-    for (j = 0; j < B->cols; j++) {
-      for (k = 0; k < A->cols; k++) {
-        result->cords[i][j] += A->cords[i][k] * B->cords[k][j];
-      }
-    }
+  if (matrix_mul_into(result, A, B, transpose_A, transpose_B) != 0) {
+    free_matrix(result);
+    return NULL;
   }
   return result;
 }
 
+Matrix* matrix_mul(Matrix* A, Matrix* B){
+  return matrix_mul_transposed(A, B, NOT_TRANSPOSED, NOT_TRANSPOSED);
+}
+
+int matrix_gram_into(Matrix* G, Matrix* H, double *scratch){
+  if (G == NULL || H == NULL || scratch == NULL || G->rows != H->cols || G->cols != H->cols) {
+    return -1;
+  }
+  profile_product(PRODUCT_GRAM, (double)H->rows * H->cols * (H->cols + 1),
+                  ((double)H->rows * H->cols + (double)H->cols * H->cols) * sizeof(double));
+  gram(H->rows, H->cols, H->data, H->stride, G->data, G->stride, scratch);
+  return 0;
+}
+
 void diag_pow(Matrix* X, double power){
   int i;
   for (i = 0; i < X->rows; i++){
@@ -84,28 +205,36 @@ void diag_pow(Matrix* X, double power){
 
 Matrix* transpose(Matrix *X){
   int i, j;
+  const double *x_row;
   Matrix* transposed = allocate_matrix(X->cols, X->rows);
   if (transposed == NULL) {
     return NULL; /* Error: memory allocation failed */
   }
   for (i = 0; i < X->rows; i++) {
+    x_row = MAT_ROW(X, i);
     for (j = 0; j < X->cols; j++) {
-      transposed->cords[j][i] = X->cords[i][j];
+      MAT_ROW(transposed, j)[i] = x_row[j];
     }
   }
   return transposed;
 }
 
 void print_matrix(Matrix *X){
-  int i, j;
-  for (i = 0; i < X->rows; i++) {
-    for (j = 0; j < X->cols; j++) {
-      printf("%.4f", X->cords[i][j]);
-      if (j != X->cols - 1) {
-        printf(","); /* No comma at the last column */
-      }
-    }
-    printf("\n");
-  }
+  write_matrix(stdout, X, FORMAT_TEXT);
+}
+
+void print_diagonal(Matrix *d){
+  write_diagonal(stdout, d, FORMAT_TEXT);
 }
 
+Matrix* diagonal_to_dense(Matrix *d){
+  int i;
+  Matrix *D = allocate_matrix(d->rows, d->rows);
+  if (D == NULL) {
+    return NULL; /* Error: memory allocation failed */
+  }
+  for (i = 0; i < d->rows; i++) {
+    MAT_ROW(D, i)[i] = d->data[i];
+  }
+  return D;
+}
@@ -6,22 +6,51 @@
 #ifndef MATRIX_H
 #define MATRIX_H
 
+#include <stddef.h>
+
+/* Alignment (in bytes) of the buffer backing every matrix */
+#define MATRIX_ALIGNMENT 64
+
+/* Operand flags for the transposing multiplication variants */
+#define NOT_TRANSPOSED 0
+#define TRANSPOSED 1
+
 /**
- * This structure holds a 2D array of doubles and its dimensions (rows and cols)
+ * This structure holds a 2D array of doubles and its dimensions (rows and cols).
+ * All elements live in one aligned, row-major buffer (`data`); element (i, j) is
+ * data[i * stride + j]. `cords` is a row-pointer view into the same buffer, kept
+ * so code can still index cords[i][j].
  */
 typedef struct {
     double **cords;
+    double *data;
     int rows;
     int cols;
+    int stride; /* distance (in doubles) between the starts of consecutive rows */
+    void *block; /* raw allocation backing `data`, released by free_matrix (NULL if not owned) */
+    size_t mapped; /* length of the file mapping at `block`, 0 if block is heap memory */
 } Matrix;
 
+/* Pointer to the first element of row i */
+#define MAT_ROW(X, i) ((X)->data + (size_t)(i) * (size_t)(X)->stride)
+
 void free_matrix(Matrix *A);
+int release_matrix(Matrix *A); /* free_matrix, 0 if a mapping behind A was also unmapped cleanly */
 void free_matrix2(Matrix *A, Matrix *B);
 void free_matrix3(Matrix *A, Matrix *B, Matrix *C);
-Matrix* allocate_matrix(int rows, int cols);
+Matrix* allocate_matrix(int rows, int cols); /* elements are zero-initialized */
+Matrix* matrix_from_buffer(int rows, int cols, double *data, void *block); /* adopts data (stride = cols) */
+void* allocate_aligned(size_t size, void **block); /* MATRIX_ALIGNMENT aligned, free(*block) to release */
+Matrix* allocate_matrix_mapped(int rows, int cols, const char *dir); /* zeroed, backed by a scratch file in dir */
+int release_block(void *block, size_t mapped); /* frees or unmaps a matrix backing block, 0 on success */
 Matrix* matrix_mul(Matrix* A, Matrix* B); /* memory allocation & error handling for return matrix */
+Matrix* matrix_mul_transposed(Matrix* A, Matrix* B, int transpose_A, int transpose_B);
+int matrix_mul_into(Matrix* C, Matrix* A, Matrix* B, int transpose_A, int transpose_B); /* 0 on success */
+int matrix_gram_into(Matrix* G, Matrix* H, double *scratch); /* G = H^T * H, see gram() in gemm.h */
 void diag_pow(Matrix* X, double power);
 Matrix* transpose(Matrix *X);
 void print_matrix(Matrix *X);
+void print_diagonal(Matrix *d); /* prints diag(d) as a dense matrix, d is n x 1 */
+Matrix* diagonal_to_dense(Matrix *d); /* diag(d) as an n x n matrix */
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,153 @@
+/**
+ * Per-thread profiles for --profile (see profile.h). The attached profile is found through
+ * a pthread key, so a hook with no profile attached costs one thread-specific lookup.
+ */
+#define _POSIX_C_SOURCE 200112L
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "profile.h"
+
+static pthread_key_t profile_key;
+static pthread_once_t profile_once = PTHREAD_ONCE_INIT;
+static int key_ready = 0;
+
+static const char *const product_names[PRODUCT_KINDS] = {"dense", "packed", "sparse", "gram"};
+
+static void create_key(void){
+  key_ready = (pthread_key_create(&profile_key, NULL) == 0);
+}
+
+static double clock_seconds(clockid_t clock){
+  struct timespec t;
+  if (clock_gettime(clock, &t) != 0) {
+    return 0.0;
+  }
+  return (double)t.tv_sec + (double)t.tv_nsec * 1e-9;
+}
+
+void profile_begin(Profile *profile){
+  pthread_once(&profile_once, create_key);
+  memset(profile, 0, sizeof(Profile));
+  profile_start(&profile->started);
+  if (key_ready) {
+    pthread_setspecific(profile_key, profile);
+  }
+}
+
+void profile_end(void){
+  Profile *profile = profile_current();
+  ProfileMark now;
+  if (profile == NULL) {
+    return;
+  }
+  profile_start(&now);
+  profile->total.wall = now.wall - profile->started.wall;
+  profile->total.cpu = now.cpu - profile->started.cpu;
+  pthread_setspecific(profile_key, NULL);
+}
+
+Profile* profile_current(void){
+  pthread_once(&profile_once, create_key);
+  return key_ready ? (Profile *)pthread_getspecific(profile_key) : NULL;
+}
+
+void profile_start(ProfileMark *mark){
+  mark->wall = clock_seconds(CLOCK_MONOTONIC);
+  mark->cpu = clock_seconds(CLOCK_PROCESS_CPUTIME_ID);
+}
+
+void profile_stop(const ProfileMark *mark, const char *phase){
+  Profile *profile = profile_current();
+  ProfilePhase *entry = NULL;
+  ProfileMark now;
+  int i;
+  if (profile == NULL) {
+    return;
+  }
+  profile_start(&now);
+  for (i = 0; i < profile->phase_count && entry == NULL; i++) {
+    if (strcmp(profile->phases[i].name, phase) == 0) {
+      entry = &profile->phases[i];
+    }
+  }
+  if (entry == NULL) {
+    if (profile->phase_count == PROFILE_MAX_PHASES) {
+      return;
+    }
+    entry = &profile->phases[profile->phase_count++];
+    entry->name = phase;
+  }
+  entry->calls++;
+  entry->wall += now.wall - mark->wall;
+  entry->cpu += now.cpu - mark->cpu;
+}
+
+void profile_iteration(double convergence){
+  Profile *profile = profile_current();
+  if (profile != NULL) {
+    profile->iterations++;
+    profile->convergence = convergence;
+  }
+}
+
+void profile_solver_status(const char *stopped){
+  Profile *profile = profile_current();
+  if (profile != NULL) {
+    profile->stopped = stopped;
+  }
+}
+
+void profile_product(int kind, double flops, double bytes){
+  Profile *profile = profile_current();
+  if (profile != NULL && kind >= 0 && kind < PRODUCT_KINDS) {
+    profile->products[kind].calls++;
+    profile->products[kind].flops += flops;
+    profile->products[kind].bytes += bytes;
+  }
+}
+
+void profile_allocation(double bytes){
+  Profile *profile = profile_current();
+  if (profile == NULL) {
+    return;
+  }
+  profile->allocated += bytes;
+  if (-profile->allocated > profile->unmatched_freed) {
+    profile->unmatched_freed = -profile->allocated; /* freed more than was allocated since attaching */
+  }
+  if (profile->allocated > profile->peak_allocated) {
+    profile->peak_allocated = profile->allocated;
+  }
+}
+
+const char* profile_product_name(int kind){
+  return (kind >= 0 && kind < PRODUCT_KINDS) ? product_names[kind] : NULL;
+}
+
+int profile_write_json(FILE *out, const Profile *profile){
+  const ProfileCounter *c;
+  int i;
+  fprintf(out, "{\"wall\": %.6f, \"cpu\": %.6f, \"phases\": [", profile->total.wall, profile->total.cpu);
+  for (i = 0; i < profile->phase_count; i++) {
+    fprintf(out, "%s{\"name\": \"%s\", \"calls\": %ld, \"wall\": %.6f, \"cpu\": %.6f}",
+            (i > 0) ? ", " : "", profile->phases[i].name, profile->phases[i].calls,
+            profile->phases[i].wall, profile->phases[i].cpu);
+  }
+  fprintf(out, "], \"iterations\": %ld, \"convergence\": %.9g, \"stopped\": ",
+          profile->iterations, profile->convergence);
+  if (profile->stopped != NULL) {
+    fprintf(out, "\"%s\", \"products\": {", profile->stopped);
+  } else {
+    fprintf(out, "null, \"products\": {");
+  }
+  for (i = 0; i < PRODUCT_KINDS; i++) {
+    c = &profile->products[i];
+    fprintf(out, "%s\"%s\": {\"calls\": %ld, \"flops\": %.17g, \"bytes\": %.17g}",
+            (i > 0) ? ", " : "", product_names[i], c->calls, c->flops, c->bytes);
+  }
+  fprintf(out, "}, \"peak_allocated_bytes\": %.17g, \"unmatched_freed_bytes\": %.17g}\n",
+          profile->peak_allocated, profile->unmatched_freed);
+  return (fflush(out) == 0 && !ferror(out)) ? 0 : -1;
+}
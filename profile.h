@@ -0,0 +1,69 @@
+/**
+ * This header file declares the instrumentation behind --profile: wall and CPU time per
+ * phase, the solver's iteration count, last convergence value and stop reason, FLOP and
+ * byte counters for every kind of matrix product, and the bytes held in heap matrices.
+ * A Profile is attached to the calling thread with profile_begin. The hooks in the library
+ * record into the profile of the thread they run on and do nothing when none is attached,
+ * so concurrent callers (e.g. Python threads) keep separate profiles. Work handed to pool
+ * workers is recorded by the call that hands it out.
+ */
+
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdio.h>
+
+#define PROFILE_MAX_PHASES 16
+
+/* Kinds of matrix products, the index into Profile.products */
+#define PRODUCT_DENSE 0 /* matrix_mul_into, and the GEMM tiles of the distance expansion */
+#define PRODUCT_PACKED 1 /* sym_matrix_mul_into */
+#define PRODUCT_SPARSE 2 /* sparse_matrix_mul_into */
+#define PRODUCT_GRAM 3 /* matrix_gram_into */
+#define PRODUCT_KINDS 4
+
+typedef struct {
+    const char *name; /* a string literal */
+    long calls;
+    double wall; /* seconds */
+    double cpu; /* CPU seconds of the whole process, so all threads */
+} ProfilePhase;
+
+typedef struct {
+    long calls;
+    double flops;
+    double bytes; /* every operand read and the result written once */
+} ProfileCounter;
+
+typedef struct {
+    double wall;
+    double cpu;
+} ProfileMark;
+
+typedef struct {
+    ProfileMark started; /* set by profile_begin */
+    ProfileMark total; /* time from profile_begin to profile_end */
+    ProfilePhase phases[PROFILE_MAX_PHASES]; /* in order of first use, later ones are dropped */
+    int phase_count;
+    long iterations; /* check_convergence calls */
+    double convergence; /* the last squared difference check_convergence saw */
+    const char *stopped; /* how the last solver run ended (see solver_status_name), or NULL */
+    ProfileCounter products[PRODUCT_KINDS];
+    double allocated; /* bytes in heap matrices allocated minus freed while attached, signed */
+    double peak_allocated;
+    double unmatched_freed; /* how far allocated fell below 0: frees with no matching allocation */
+} Profile;
+
+void profile_begin(Profile *profile); /* clears profile and attaches it to the calling thread */
+void profile_end(void); /* fills in the total time and detaches the profile */
+Profile* profile_current(void); /* NULL when none is attached */
+void profile_start(ProfileMark *mark);
+void profile_stop(const ProfileMark *mark, const char *phase); /* adds the time since mark */
+void profile_iteration(double convergence);
+void profile_solver_status(const char *stopped); /* a string literal */
+void profile_product(int kind, double flops, double bytes);
+void profile_allocation(double bytes); /* negative when freed */
+const char* profile_product_name(int kind);
+int profile_write_json(FILE *out, const Profile *profile); /* one line, 0 on success */
+
+#endif
@@ -0,0 +1,50 @@
+/**
+ * MT19937 as published by Matsumoto and Nishimura, with the seeding and double
+ * conversion used by NumPy's RandomState (see rng.h).
+ */
+#include "rng.h"
+
+#define WORD_MASK 0xffffffffUL
+#define SHIFT_SIZE 397
+#define MATRIX_A 0x9908b0dfUL
+#define UPPER_MASK 0x80000000UL
+#define LOWER_MASK 0x7fffffffUL
+
+void rng_seed(Rng *rng, unsigned long seed){
+  int i;
+  rng->state[0] = seed & WORD_MASK;
+  for (i = 1; i < RNG_STATE_SIZE; i++) {
+    rng->state[i] = (1812433253UL * (rng->state[i - 1] ^ (rng->state[i - 1] >> 30)) +
+                     (unsigned long)i) & WORD_MASK;
+  }
+  rng->position = RNG_STATE_SIZE;
+}
+
+/* Regenerates the whole state block */
+static void refill(Rng *rng){
+  unsigned long y, *mt = rng->state;
+  int i;
+  for (i = 0; i < RNG_STATE_SIZE; i++) {
+    y = (mt[i] & UPPER_MASK) | (mt[(i + 1) % RNG_STATE_SIZE] & LOWER_MASK);
+    mt[i] = mt[(i + SHIFT_SIZE) % RNG_STATE_SIZE] ^ (y >> 1) ^ ((y & 1UL) ? MATRIX_A : 0UL);
+  }
+  rng->position = 0;
+}
+
+unsigned long rng_next32(Rng *rng){
+  unsigned long y;
+  if (rng->position >= RNG_STATE_SIZE) {
+    refill(rng);
+  }
+  y = rng->state[rng->position++];
+  y ^= (y >> 11);
+  y ^= (y << 7) & 0x9d2c5680UL;
+  y ^= (y << 15) & 0xefc60000UL;
+  y ^= (y >> 18);
+  return y & WORD_MASK;
+}
+
+double rng_uniform(Rng *rng){
+  unsigned long a = rng_next32(rng) >> 5, b = rng_next32(rng) >> 6;
+  return ((double)a * 67108864.0 + (double)b) / 9007199254740992.0;
+}
@@ -0,0 +1,21 @@
+/**
+ * This header file declares a small MT19937 generator. It follows NumPy's legacy
+ * RandomState bit for bit (seeding from a 32 bit integer, 53 bit doubles), so an H
+ * initialized in C matches np.random.seed(seed); np.random.uniform(0, 1, ...).
+ */
+
+#ifndef RNG_H
+#define RNG_H
+
+#define RNG_STATE_SIZE 624
+
+typedef struct {
+    unsigned long state[RNG_STATE_SIZE]; /* only the low 32 bits are used */
+    int position; /* next word of state to temper, RNG_STATE_SIZE when a refill is due */
+} Rng;
+
+void rng_seed(Rng *rng, unsigned long seed); /* like np.random.seed(seed), seed < 2^32 */
+unsigned long rng_next32(Rng *rng);
+double rng_uniform(Rng *rng); /* uniform on [0, 1), like np.random.random_sample() */
+
+#endif
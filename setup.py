@@ -0,0 +1,19 @@
+from setuptools import Extension, setup
+import numpy as np
+
+module = Extension(
+    "symnmfmodule",
+    sources=["symnmfmodule.c", "symnmf.c", "mat_utils.c", "utils.c", "gemm.c", "simd.c",
+             "threadpool.c", "symmat.c", "mapped.c", "rng.c",
+             "sparse.c", "kdtree.c", "profile.c"],
+    include_dirs=[np.get_include()],
+    libraries=["m", "pthread"],
+    define_macros=[("SYMNMF_NO_MAIN", None)],  # leave out the CLI, as for symnmf_bench
+)
+
+setup(
+    name="symnmfmodule",
+    version="1.0",
+    description="C extension for the SymNMF algorithm",
+    ext_modules=[module],
+)
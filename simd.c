@@ -0,0 +1,395 @@
+/**
+ * Scalar, AVX2+FMA and AVX-512 variants of the inner loops listed in simd.h.
+ * The vector variants are compiled with per-function target attributes, so the rest of the
+ * build keeps its baseline flags and the binary still runs on CPUs without these extensions.
+ * Vector reductions are summed lane by lane in a fixed order, so a given level always
+ * produces the same result; levels differ from each other only by rounding.
+ */
+#define _POSIX_C_SOURCE 200112L
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include "simd.h"
+#include "gemm.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && !defined(SYMNMF_NO_SIMD)
+#define SIMD_X86 1
+#include <immintrin.h>
+#define TARGET_AVX2 __attribute__((target("avx2,fma")))
+#define TARGET_AVX512 __attribute__((target("avx512f")))
+#endif
+
+/**
+ * exp_tile writes x = k ln2 + r with k = round(x / ln2) and |r| <= ln2 / 2, evaluates exp(r)
+ * with its degree 13 Taylor polynomial (the truncation error is below 1e-17 on that interval)
+ * and multiplies by 2^k through the exponent bits. ln2 is split into a high part whose
+ * products with k are exact and a small correction, so r carries no cancellation error.
+ * Over [EXP_MIN, EXP_MAX] the result is within EXP_TILE_MAX_ULP of exp(x) at every level;
+ * below EXP_MIN, where exp(x) would be subnormal, it is flushed to 0, above EXP_MAX it is
+ * +inf, and NaN stays NaN.
+ */
+#define EXP_MIN -708.0
+#define EXP_MAX 709.0
+#define EXP_LOG2E 1.4426950408889634
+#define EXP_LN2_HI 6.93147180369123816490e-01
+#define EXP_LN2_LO 1.90821492927058770002e-10
+#define EXP_DEGREE 13
+
+/* 1/13!, 1/12!, ..., 1/1!, 1/0!, in Horner order */
+static const double exp_coefficients[EXP_DEGREE + 1] = {
+  1.0 / 6227020800.0, 1.0 / 479001600.0, 1.0 / 39916800.0, 1.0 / 3628800.0, 1.0 / 362880.0,
+  1.0 / 40320.0, 1.0 / 5040.0, 1.0 / 720.0, 1.0 / 120.0, 1.0 / 24.0, 1.0 / 6.0, 0.5, 1.0, 1.0
+};
+
+/* Scalar kernels */
+
+static void gemm_kernel_scalar(int kc, const double *a, const double *b,
+                               double *C, int ldc, int m_r, int n_r){
+  double acc[GEMM_MR * GEMM_NR];
+  double a_r;
+  int p, r, c;
+  memset(acc, 0, sizeof(acc));
+  for (p = 0; p < kc; p++) {
+    for (r = 0; r < GEMM_MR; r++) {
+      a_r = a[r];
+      for (c = 0; c < GEMM_NR; c++) {
+        acc[r * GEMM_NR + c] += a_r * b[c];
+      }
+    }
+    a += GEMM_MR;
+    b += GEMM_NR;
+  }
+  for (r = 0; r < m_r; r++) {
+    for (c = 0; c < n_r; c++) {
+      C[(size_t)r * ldc + c] += acc[r * GEMM_NR + c];
+    }
+  }
+}
+
+static double squared_distance_scalar(const double *x, const double *y, size_t n){
+  double sum = 0.0, diff;
+  size_t i;
+  for (i = 0; i < n; i++) {
+    diff = x[i] - y[i];
+    sum += diff * diff;
+  }
+  return sum;
+}
+
+static double mu_update_scalar(double *next, const double *h, const double *numer,
+                               const double *denom, size_t n, double beta){
+  double sum = 0.0, diff;
+  size_t i;
+  for (i = 0; i < n; i++) {
+    next[i] = h[i] * (1 - beta + beta * (numer[i] / denom[i]));
+    diff = next[i] - h[i];
+    sum += diff * diff;
+  }
+  return sum;
+}
+
+static void exp_tile_scalar(double *y, const double *x, size_t n){
+  double v, k, r, p;
+  size_t i;
+  int c;
+  for (i = 0; i < n; i++) {
+    v = x[i];
+    if (v < EXP_MIN) {
+      y[i] = 0;
+    } else if (v > EXP_MAX) {
+      y[i] = HUGE_VAL;
+    } else if (v != v) {
+      y[i] = v;
+    } else {
+      k = floor(v * EXP_LOG2E + 0.5);
+      r = (v - k * EXP_LN2_HI) - k * EXP_LN2_LO;
+      p = exp_coefficients[0];
+      for (c = 1; c <= EXP_DEGREE; c++) {
+        p = p * r + exp_coefficients[c];
+      }
+      y[i] = ldexp(p, (int)k);
+    }
+  }
+}
+
+static const SimdKernels scalar_kernels = {
+  "scalar", gemm_kernel_scalar, squared_distance_scalar, mu_update_scalar, exp_tile_scalar
+};
+
+#ifdef SIMD_X86
+
+/* AVX2 + FMA kernels */
+
+TARGET_AVX2 static void gemm_kernel_avx2(int kc, const double *a, const double *b,
+                                         double *C, int ldc, int m_r, int n_r){
+  __m256d c00 = _mm256_setzero_pd(), c01 = _mm256_setzero_pd();
+  __m256d c10 = _mm256_setzero_pd(), c11 = _mm256_setzero_pd();
+  __m256d c20 = _mm256_setzero_pd(), c21 = _mm256_setzero_pd();
+  __m256d c30 = _mm256_setzero_pd(), c31 = _mm256_setzero_pd();
+  __m256d b0, b1, a_r;
+  double acc[GEMM_MR * GEMM_NR];
+  int p, r, c;
+  for (p = 0; p < kc; p++) {
+    b0 = _mm256_loadu_pd(b);
+    b1 = _mm256_loadu_pd(b + 4);
+    a_r = _mm256_broadcast_sd(a);
+    c00 = _mm256_fmadd_pd(a_r, b0, c00);
+    c01 = _mm256_fmadd_pd(a_r, b1, c01);
+    a_r = _mm256_broadcast_sd(a + 1);
+    c10 = _mm256_fmadd_pd(a_r, b0, c10);
+    c11 = _mm256_fmadd_pd(a_r, b1, c11);
+    a_r = _mm256_broadcast_sd(a + 2);
+    c20 = _mm256_fmadd_pd(a_r, b0, c20);
+    c21 = _mm256_fmadd_pd(a_r, b1, c21);
+    a_r = _mm256_broadcast_sd(a + 3);
+    c30 = _mm256_fmadd_pd(a_r, b0, c30);
+    c31 = _mm256_fmadd_pd(a_r, b1, c31);
+    a += GEMM_MR;
+    b += GEMM_NR;
+  }
+  if (m_r == GEMM_MR && n_r == GEMM_NR) {
+    _mm256_storeu_pd(C, _mm256_add_pd(_mm256_loadu_pd(C), c00));
+    _mm256_storeu_pd(C + 4, _mm256_add_pd(_mm256_loadu_pd(C + 4), c01));
+    C += ldc;
+    _mm256_storeu_pd(C, _mm256_add_pd(_mm256_loadu_pd(C), c10));
+    _mm256_storeu_pd(C + 4, _mm256_add_pd(_mm256_loadu_pd(C + 4), c11));
+    C += ldc;
+    _mm256_storeu_pd(C, _mm256_add_pd(_mm256_loadu_pd(C), c20));
+    _mm256_storeu_pd(C + 4, _mm256_add_pd(_mm256_loadu_pd(C + 4), c21));
+    C += ldc;
+    _mm256_storeu_pd(C, _mm256_add_pd(_mm256_loadu_pd(C), c30));
+    _mm256_storeu_pd(C + 4, _mm256_add_pd(_mm256_loadu_pd(C + 4), c31));
+    return;
+  }
+  _mm256_storeu_pd(acc, c00);
+  _mm256_storeu_pd(acc + 4, c01);
+  _mm256_storeu_pd(acc + 8, c10);
+  _mm256_storeu_pd(acc + 12, c11);
+  _mm256_storeu_pd(acc + 16, c20);
+  _mm256_storeu_pd(acc + 20, c21);
+  _mm256_storeu_pd(acc + 24, c30);
+  _mm256_storeu_pd(acc + 28, c31);
+  for (r = 0; r < m_r; r++) {
+    for (c = 0; c < n_r; c++) {
+      C[(size_t)r * ldc + c] += acc[r * GEMM_NR + c];
+    }
+  }
+}
+
+TARGET_AVX2 static double squared_distance_avx2(const double *x, const double *y, size_t n){
+  __m256d sum0 = _mm256_setzero_pd(), sum1 = _mm256_setzero_pd(), diff;
+  double lanes[4], sum, d;
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    diff = _mm256_sub_pd(_mm256_loadu_pd(x + i), _mm256_loadu_pd(y + i));
+    sum0 = _mm256_fmadd_pd(diff, diff, sum0);
+    diff = _mm256_sub_pd(_mm256_loadu_pd(x + i + 4), _mm256_loadu_pd(y + i + 4));
+    sum1 = _mm256_fmadd_pd(diff, diff, sum1);
+  }
+  for (; i + 4 <= n; i += 4) {
+    diff = _mm256_sub_pd(_mm256_loadu_pd(x + i), _mm256_loadu_pd(y + i));
+    sum0 = _mm256_fmadd_pd(diff, diff, sum0);
+  }
+  _mm256_storeu_pd(lanes, _mm256_add_pd(sum0, sum1));
+  sum = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+  for (; i < n; i++) {
+    d = x[i] - y[i];
+    sum += d * d;
+  }
+  return sum;
+}
+
+TARGET_AVX2 static double mu_update_avx2(double *next, const double *h, const double *numer,
+                                         const double *denom, size_t n, double beta){
+  __m256d v_beta = _mm256_set1_pd(beta), v_keep = _mm256_set1_pd(1 - beta);
+  __m256d ratio, h_v, next_v, diff, sum = _mm256_setzero_pd();
+  double lanes[4];
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    h_v = _mm256_loadu_pd(h + i);
+    ratio = _mm256_div_pd(_mm256_loadu_pd(numer + i), _mm256_loadu_pd(denom + i));
+    ratio = _mm256_fmadd_pd(v_beta, ratio, v_keep);
+    next_v = _mm256_mul_pd(h_v, ratio);
+    _mm256_storeu_pd(next + i, next_v);
+    diff = _mm256_sub_pd(next_v, h_v);
+    sum = _mm256_fmadd_pd(diff, diff, sum);
+  }
+  _mm256_storeu_pd(lanes, sum);
+  return (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]) +
+         mu_update_scalar(next + i, h + i, numer + i, denom + i, n - i, beta);
+}
+
+TARGET_AVX2 static void exp_tile_avx2(double *y, const double *x, size_t n){
+  __m256d v, k, r, p, result;
+  __m256i bits;
+  size_t i = 0;
+  int c;
+  for (; i + 4 <= n; i += 4) {
+    v = _mm256_loadu_pd(x + i);
+    r = _mm256_min_pd(_mm256_max_pd(v, _mm256_set1_pd(EXP_MIN)), _mm256_set1_pd(EXP_MAX));
+    k = _mm256_round_pd(_mm256_mul_pd(r, _mm256_set1_pd(EXP_LOG2E)),
+                        _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+    r = _mm256_fnmadd_pd(k, _mm256_set1_pd(EXP_LN2_HI), r);
+    r = _mm256_fnmadd_pd(k, _mm256_set1_pd(EXP_LN2_LO), r);
+    p = _mm256_set1_pd(exp_coefficients[0]);
+    for (c = 1; c <= EXP_DEGREE; c++) {
+      p = _mm256_fmadd_pd(p, r, _mm256_set1_pd(exp_coefficients[c]));
+    }
+    bits = _mm256_add_epi64(_mm256_cvtepi32_epi64(_mm256_cvtpd_epi32(k)), _mm256_set1_epi64x(1023));
+    result = _mm256_mul_pd(p, _mm256_castsi256_pd(_mm256_slli_epi64(bits, 52)));
+    result = _mm256_blendv_pd(result, _mm256_setzero_pd(),
+                              _mm256_cmp_pd(v, _mm256_set1_pd(EXP_MIN), _CMP_LT_OQ));
+    result = _mm256_blendv_pd(result, _mm256_set1_pd(HUGE_VAL),
+                              _mm256_cmp_pd(v, _mm256_set1_pd(EXP_MAX), _CMP_GT_OQ));
+    result = _mm256_blendv_pd(result, v, _mm256_cmp_pd(v, v, _CMP_UNORD_Q));
+    _mm256_storeu_pd(y + i, result);
+  }
+  exp_tile_scalar(y + i, x + i, n - i);
+}
+
+static const SimdKernels avx2_kernels = {
+  "avx2", gemm_kernel_avx2, squared_distance_avx2, mu_update_avx2, exp_tile_avx2
+};
+
+/* AVX-512 kernels */
+
+TARGET_AVX512 static void gemm_kernel_avx512(int kc, const double *a, const double *b,
+                                             double *C, int ldc, int m_r, int n_r){
+  __m512d c0 = _mm512_setzero_pd(), c1 = _mm512_setzero_pd();
+  __m512d c2 = _mm512_setzero_pd(), c3 = _mm512_setzero_pd();
+  __m512d b0;
+  double acc[GEMM_MR * GEMM_NR];
+  int p, r, c;
+  for (p = 0; p < kc; p++) {
+    b0 = _mm512_loadu_pd(b);
+    c0 = _mm512_fmadd_pd(_mm512_set1_pd(a[0]), b0, c0);
+    c1 = _mm512_fmadd_pd(_mm512_set1_pd(a[1]), b0, c1);
+    c2 = _mm512_fmadd_pd(_mm512_set1_pd(a[2]), b0, c2);
+    c3 = _mm512_fmadd_pd(_mm512_set1_pd(a[3]), b0, c3);
+    a += GEMM_MR;
+    b += GEMM_NR;
+  }
+  if (m_r == GEMM_MR && n_r == GEMM_NR) {
+    _mm512_storeu_pd(C, _mm512_add_pd(_mm512_loadu_pd(C), c0));
+    C += ldc;
+    _mm512_storeu_pd(C, _mm512_add_pd(_mm512_loadu_pd(C), c1));
+    C += ldc;
+    _mm512_storeu_pd(C, _mm512_add_pd(_mm512_loadu_pd(C), c2));
+    C += ldc;
+    _mm512_storeu_pd(C, _mm512_add_pd(_mm512_loadu_pd(C), c3));
+    return;
+  }
+  _mm512_storeu_pd(acc, c0);
+  _mm512_storeu_pd(acc + 8, c1);
+  _mm512_storeu_pd(acc + 16, c2);
+  _mm512_storeu_pd(acc + 24, c3);
+  for (r = 0; r < m_r; r++) {
+    for (c = 0; c < n_r; c++) {
+      C[(size_t)r * ldc + c] += acc[r * GEMM_NR + c];
+    }
+  }
+}
+
+TARGET_AVX512 static double squared_distance_avx512(const double *x, const double *y, size_t n){
+  __m512d sum = _mm512_setzero_pd(), diff;
+  double lanes[8], total, d;
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    diff = _mm512_sub_pd(_mm512_loadu_pd(x + i), _mm512_loadu_pd(y + i));
+    sum = _mm512_fmadd_pd(diff, diff, sum);
+  }
+  _mm512_storeu_pd(lanes, sum);
+  total = ((lanes[0] + lanes[1]) + (lanes[2] + lanes[3])) + ((lanes[4] + lanes[5]) + (lanes[6] + lanes[7]));
+  for (; i < n; i++) {
+    d = x[i] - y[i];
+    total += d * d;
+  }
+  return total;
+}
+
+TARGET_AVX512 static double mu_update_avx512(double *next, const double *h, const double *numer,
+                                             const double *denom, size_t n, double beta){
+  __m512d v_beta = _mm512_set1_pd(beta), v_keep = _mm512_set1_pd(1 - beta);
+  __m512d ratio, h_v, next_v, diff, sum = _mm512_setzero_pd();
+  double lanes[8];
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    h_v = _mm512_loadu_pd(h + i);
+    ratio = _mm512_div_pd(_mm512_loadu_pd(numer + i), _mm512_loadu_pd(denom + i));
+    ratio = _mm512_fmadd_pd(v_beta, ratio, v_keep);
+    next_v = _mm512_mul_pd(h_v, ratio);
+    _mm512_storeu_pd(next + i, next_v);
+    diff = _mm512_sub_pd(next_v, h_v);
+    sum = _mm512_fmadd_pd(diff, diff, sum);
+  }
+  _mm512_storeu_pd(lanes, sum);
+  return ((lanes[0] + lanes[1]) + (lanes[2] + lanes[3])) + ((lanes[4] + lanes[5]) + (lanes[6] + lanes[7])) +
+         mu_update_scalar(next + i, h + i, numer + i, denom + i, n - i, beta);
+}
+
+TARGET_AVX512 static void exp_tile_avx512(double *y, const double *x, size_t n){
+  __m512d v, k, r, p, result;
+  size_t i = 0;
+  int c;
+  for (; i + 8 <= n; i += 8) {
+    v = _mm512_loadu_pd(x + i);
+    r = _mm512_min_pd(_mm512_max_pd(v, _mm512_set1_pd(EXP_MIN)), _mm512_set1_pd(EXP_MAX));
+    k = _mm512_roundscale_pd(_mm512_mul_pd(r, _mm512_set1_pd(EXP_LOG2E)), _MM_FROUND_TO_NEAREST_INT);
+    r = _mm512_fnmadd_pd(k, _mm512_set1_pd(EXP_LN2_HI), r);
+    r = _mm512_fnmadd_pd(k, _mm512_set1_pd(EXP_LN2_LO), r);
+    p = _mm512_set1_pd(exp_coefficients[0]);
+    for (c = 1; c <= EXP_DEGREE; c++) {
+      p = _mm512_fmadd_pd(p, r, _mm512_set1_pd(exp_coefficients[c]));
+    }
+    result = _mm512_scalef_pd(p, k);
+    result = _mm512_mask_blend_pd(_mm512_cmp_pd_mask(v, _mm512_set1_pd(EXP_MIN), _CMP_LT_OQ),
+                                  result, _mm512_setzero_pd());
+    result = _mm512_mask_blend_pd(_mm512_cmp_pd_mask(v, _mm512_set1_pd(EXP_MAX), _CMP_GT_OQ),
+                                  result, _mm512_set1_pd(HUGE_VAL));
+    result = _mm512_mask_blend_pd(_mm512_cmp_pd_mask(v, v, _CMP_UNORD_Q), result, v);
+    _mm512_storeu_pd(y + i, result);
+  }
+  exp_tile_scalar(y + i, x + i, n - i);
+}
+
+static const SimdKernels avx512_kernels = {
+  "avx512", gemm_kernel_avx512, squared_distance_avx512, mu_update_avx512, exp_tile_avx512
+};
+
+#endif
+
+/* Highest level the CPU supports, capped by SYMNMF_SIMD when it is set */
+static const SimdKernels* select_kernels(void){
+#ifdef SIMD_X86
+  const char *requested = getenv("SYMNMF_SIMD");
+  int allow_avx512 = 1, allow_avx2 = 1;
+  if (requested != NULL) {
+    if (strcmp(requested, "scalar") == 0) {
+      allow_avx2 = allow_avx512 = 0;
+    } else if (strcmp(requested, "avx2") == 0) {
+      allow_avx512 = 0;
+    }
+  }
+  __builtin_cpu_init();
+  if (allow_avx512 && __builtin_cpu_supports("avx512f")) {
+    return &avx512_kernels;
+  }
+  if (allow_avx2 && __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+    return &avx2_kernels;
+  }
+#endif
+  return &scalar_kernels;
+}
+
+static pthread_once_t selection_once = PTHREAD_ONCE_INIT;
+static const SimdKernels *selected = NULL; /* written once, under selection_once */
+
+static void select_once(void){
+  selected = select_kernels();
+}
+
+const SimdKernels* simd_kernels(void){
+  pthread_once(&selection_once, select_once);
+  return selected;
+}
@@ -0,0 +1,30 @@
+/**
+ * This header file declares the table of inner-loop kernels that are specialized per
+ * instruction set (scalar, AVX2+FMA, AVX-512). The best variant the CPU supports is
+ * picked on first use; the SYMNMF_SIMD environment variable ("scalar", "avx2", "avx512")
+ * can force a lower level, e.g. to compare results against the scalar path.
+ */
+
+#ifndef SIMD_H
+#define SIMD_H
+
+#include <stddef.h>
+
+#define EXP_TILE_MAX_ULP 2 /* worst error of exp_tile against the exact exp, in units in the last place */
+
+typedef struct {
+    const char *name;
+    /* C[0..m_r, 0..n_r] += a * b for a packed GEMM_MR x kc sliver a and kc x GEMM_NR sliver b */
+    void (*gemm_kernel)(int kc, const double *a, const double *b, double *C, int ldc, int m_r, int n_r);
+    /* sum over i of (x[i] - y[i])^2 */
+    double (*squared_distance)(const double *x, const double *y, size_t n);
+    /* next[i] = h[i] * (1 - beta + beta * numer[i] / denom[i]), returns sum of (next[i] - h[i])^2 */
+    double (*mu_update)(double *next, const double *h, const double *numer, const double *denom,
+                        size_t n, double beta);
+    /* y[i] = exp(x[i]) to within EXP_TILE_MAX_ULP (y may be x), see simd.c for the range */
+    void (*exp_tile)(double *y, const double *x, size_t n);
+} SimdKernels;
+
+const SimdKernels* simd_kernels(void);
+
+#endif
@@ -0,0 +1,267 @@
+/**
+ * CSR matrices for the sparse similarity graph. Every product row is summed over its
+ * stored columns in increasing order by a single worker, so results do not depend on
+ * the number of threads.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "sparse.h"
+#include "threadpool.h"
+#include "profile.h"
+
+#define SPMM_GRAIN 64 /* rows per parallel_for chunk */
+
+/* Bytes of the CSR arrays of an n x n matrix with nnz stored entries */
+static double csr_bytes(int n, size_t nnz){
+  return ((double)n + 1.0) * sizeof(size_t) + (double)nnz * (sizeof(int) + sizeof(double));
+}
+
+SparseMatrix* allocate_sparse_matrix(int n, size_t nnz){
+  SparseMatrix *S;
+  if (n < 0 || nnz > ((size_t)-1) / sizeof(double)) {
+    return NULL;
+  }
+  S = (SparseMatrix *)calloc(1, sizeof(SparseMatrix));
+  if (S == NULL) {
+    return NULL;
+  }
+  S->n = n;
+  S->nnz = nnz;
+  S->row_start = (size_t *)calloc((size_t)n + 1, sizeof(size_t));
+  S->columns = (int *)malloc((nnz > 0 ? nnz : 1) * sizeof(int));
+  S->values = (double *)malloc((nnz > 0 ? nnz : 1) * sizeof(double));
+  if (S->row_start == NULL || S->columns == NULL || S->values == NULL) {
+    free_sparse_matrix(S);
+    return NULL;
+  }
+  profile_allocation(csr_bytes(n, nnz));
+  return S;
+}
+
+void free_sparse_matrix(SparseMatrix *S){
+  if (S != NULL) {
+    if (S->row_start != NULL && S->columns != NULL && S->values != NULL) {
+      profile_allocation(-csr_bytes(S->n, S->nnz));
+    }
+    free(S->row_start);
+    free(S->columns);
+    free(S->values);
+    free(S);
+  }
+}
+
+double sparse_get(const SparseMatrix *S, int i, int j){
+  size_t low = S->row_start[i], high = S->row_start[i + 1], middle;
+  while (low < high) {
+    middle = low + (high - low) / 2;
+    if (S->columns[middle] < j) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+  return (low < S->row_start[i + 1] && S->columns[low] == j) ? S->values[low] : 0.0;
+}
+
+/* Restores the max-heap on index below slot t, moving distance along */
+static void sift_by_index(int *index, double *distance, int count, int t){
+  int child, swap_index;
+  double swap_distance;
+  for (;;) {
+    child = 2 * t + 1;
+    if (child >= count) {
+      return;
+    }
+    if (child + 1 < count && index[child + 1] > index[child]) {
+      child++;
+    }
+    if (index[child] <= index[t]) {
+      return;
+    }
+    swap_index = index[t];
+    swap_distance = distance[t];
+    index[t] = index[child];
+    distance[t] = distance[child];
+    index[child] = swap_index;
+    distance[child] = swap_distance;
+    t = child;
+  }
+}
+
+void sort_neighbors(int *index, double *distance, int count){
+  int t, swap_index;
+  double swap_distance;
+  for (t = count / 2 - 1; t >= 0; t--) {
+    sift_by_index(index, distance, count, t);
+  }
+  for (t = count - 1; t > 0; t--) { /* heapsort: move the largest index to the back */
+    swap_index = index[0];
+    swap_distance = distance[0];
+    index[0] = index[t];
+    distance[0] = distance[t];
+    index[t] = swap_index;
+    distance[t] = swap_distance;
+    sift_by_index(index, distance, t, 0);
+  }
+}
+
+/**
+ * Merges row i of the directed lists (sorted) with its reversed edges (sorted by source),
+ * writing the union into the CSR arrays at *position, or only counting it when S is NULL.
+ */
+static size_t merge_row(int i, int width, const int *counts, const int *index, const double *distance,
+                        const size_t *reverse_start, const int *reverse_index,
+                        const double *reverse_distance, SparseMatrix *S){
+  size_t a = (size_t)i * (size_t)width, a_end = a + (size_t)counts[i];
+  size_t b = reverse_start[i], b_end = reverse_start[i + 1];
+  size_t out = (S != NULL) ? S->row_start[i] : 0, written = 0;
+  int column;
+  double d;
+  while (a < a_end || b < b_end) {
+    if (b == b_end || (a < a_end && index[a] < reverse_index[b])) {
+      column = index[a];
+      d = distance[a++];
+    } else if (a == a_end || reverse_index[b] < index[a]) {
+      column = reverse_index[b];
+      d = reverse_distance[b++];
+    } else { /* both directions hold the edge */
+      column = index[a];
+      d = distance[a++];
+      b++;
+    }
+    if (S != NULL) {
+      S->columns[out + written] = column;
+      S->values[out + written] = d;
+    }
+    written++;
+  }
+  return written;
+}
+
+SparseMatrix* sparse_from_neighbors(int n, int width, const int *counts, const int *neighbors,
+                                    const double *distances){
+  int *index, *reverse_index;
+  double *distance, *reverse_distance;
+  size_t *reverse_start, *fill, total = 0, t, slots = (size_t)n * (size_t)(width > 0 ? width : 1);
+  SparseMatrix *S = NULL;
+  int i, u, j;
+  index = (int *)malloc(slots * sizeof(int));
+  distance = (double *)malloc(slots * sizeof(double));
+  reverse_start = (size_t *)calloc((size_t)n + 1, sizeof(size_t));
+  fill = (size_t *)malloc(((size_t)n + 1) * sizeof(size_t));
+  if (index == NULL || distance == NULL || reverse_start == NULL || fill == NULL) {
+    free(index);
+    free(distance);
+    free(reverse_start);
+    free(fill);
+    return NULL;
+  }
+  /* sorted copies of the directed lists, and the reversed edges grouped by target */
+  for (i = 0; i < n; i++) {
+    t = (size_t)i * (size_t)width;
+    memcpy(index + t, neighbors + t, (size_t)counts[i] * sizeof(int));
+    memcpy(distance + t, distances + t, (size_t)counts[i] * sizeof(double));
+    sort_neighbors(index + t, distance + t, counts[i]);
+    for (u = 0; u < counts[i]; u++) {
+      reverse_start[index[t + (size_t)u] + 1]++;
+    }
+  }
+  for (i = 0; i < n; i++) {
+    reverse_start[i + 1] += reverse_start[i];
+  }
+  reverse_index = (int *)malloc((reverse_start[n] > 0 ? reverse_start[n] : 1) * sizeof(int));
+  reverse_distance = (double *)malloc((reverse_start[n] > 0 ? reverse_start[n] : 1) * sizeof(double));
+  if (reverse_index != NULL && reverse_distance != NULL) {
+    memcpy(fill, reverse_start, ((size_t)n + 1) * sizeof(size_t));
+    for (i = 0; i < n; i++) { /* sources in increasing order, so each group comes out sorted */
+      for (u = 0; u < counts[i]; u++) {
+        t = (size_t)i * (size_t)width + (size_t)u;
+        j = index[t];
+        reverse_index[fill[j]] = i;
+        reverse_distance[fill[j]++] = distance[t];
+      }
+    }
+    for (i = 0; i < n; i++) {
+      fill[i] = merge_row(i, width, counts, index, distance, reverse_start, reverse_index,
+                          reverse_distance, NULL);
+      total += fill[i];
+    }
+    S = allocate_sparse_matrix(n, total);
+  }
+  if (S != NULL) {
+    for (i = 0; i < n; i++) {
+      S->row_start[i + 1] = S->row_start[i] + fill[i];
+    }
+    for (i = 0; i < n; i++) {
+      merge_row(i, width, counts, index, distance, reverse_start, reverse_index,
+                reverse_distance, S);
+    }
+  }
+  free(index);
+  free(distance);
+  free(reverse_start);
+  free(fill);
+  free(reverse_index);
+  free(reverse_distance);
+  return S;
+}
+
+typedef struct {
+    Matrix *C;
+    SparseMatrix *S;
+    Matrix *B;
+} SpmmJob;
+
+/* C[i] = sum over stored (i, j) of S[i][j] * B[j], for rows [begin, end) */
+static void spmm_task(void *context, int begin, int end, int worker){
+  SpmmJob *job = (SpmmJob *)context;
+  const SparseMatrix *S = job->S;
+  const double *b_row;
+  double *c_row, weight;
+  size_t p;
+  int i, c, k = job->B->cols;
+  (void)worker;
+  for (i = begin; i < end; i++) {
+    c_row = MAT_ROW(job->C, i);
+    memset(c_row, 0, (size_t)k * sizeof(double));
+    for (p = S->row_start[i]; p < S->row_start[i + 1]; p++) {
+      weight = S->values[p];
+      b_row = MAT_ROW(job->B, S->columns[p]);
+      for (c = 0; c < k; c++) {
+        c_row[c] += weight * b_row[c];
+      }
+    }
+  }
+}
+
+int sparse_matrix_mul_into(Matrix *C, SparseMatrix *S, Matrix *B){
+  SpmmJob job;
+  if (C == NULL || S == NULL || B == NULL || B->rows != S->n ||
+      C->rows != S->n || C->cols != B->cols || C == B) {
+    return -1; /* Error: matrices cannot be multiplied */
+  }
+  profile_product(PRODUCT_SPARSE, 2.0 * (double)S->nnz * B->cols,
+                  csr_bytes(S->n, S->nnz) + 2.0 * S->n * B->cols * sizeof(double));
+  job.C = C;
+  job.S = S;
+  job.B = B;
+  parallel_for(S->n, SPMM_GRAIN, spmm_task, &job);
+  return 0;
+}
+
+int sparse_row_sums(Matrix *d, SparseMatrix *S){
+  size_t p;
+  double sum;
+  int i;
+  if (d == NULL || S == NULL || d->rows != S->n || d->cols != 1) {
+    return -1;
+  }
+  for (i = 0; i < S->n; i++) {
+    sum = 0.0;
+    for (p = S->row_start[i]; p < S->row_start[i + 1]; p++) {
+      sum += S->values[p];
+    }
+    d->data[i] = sum;
+  }
+  return 0;
+}
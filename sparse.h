@@ -0,0 +1,42 @@
+/**
+ * This header file defines `SparseMatrix`, a square matrix in compressed sparse row (CSR)
+ * form, and declares the operations the sparse similarity graph needs: building a symmetric
+ * graph from per-point neighbor lists, row sums and the sparse-times-dense product (SpMM).
+ * Memory is O(n + nnz) instead of O(n^2).
+ */
+
+#ifndef SPARSE_H
+#define SPARSE_H
+
+#include <stddef.h>
+#include "mat_utils.h"
+
+/**
+ * Row i holds the entries at positions row_start[i] .. row_start[i + 1] - 1 of `columns`
+ * and `values`, with strictly increasing column indices.
+ */
+typedef struct {
+    int n;
+    size_t nnz;
+    size_t *row_start; /* n + 1 offsets */
+    int *columns;
+    double *values;
+} SparseMatrix;
+
+SparseMatrix* allocate_sparse_matrix(int n, size_t nnz); /* row_start is zeroed */
+void free_sparse_matrix(SparseMatrix *S);
+
+/**
+ * Builds the symmetric graph whose edge (i, j) exists when j is among point i's neighbors
+ * or i among point j's (the union). neighbors[i * width + t], t < counts[i], are point i's
+ * neighbor indices and distances[...] the matching squared distances, which must be the
+ * same for (i, j) and (j, i). Entries hold the distances, NULL on error.
+ */
+SparseMatrix* sparse_from_neighbors(int n, int width, const int *counts, const int *neighbors,
+                                    const double *distances);
+int sparse_row_sums(Matrix *d, SparseMatrix *S); /* d (n x 1) = S * (1, ..., 1), 0 on success */
+int sparse_matrix_mul_into(Matrix *C, SparseMatrix *S, Matrix *B); /* C = S * B, 0 on success */
+double sparse_get(const SparseMatrix *S, int i, int j);
+void sort_neighbors(int *index, double *values, int count); /* by increasing index, values follow */
+
+#endif
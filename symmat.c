@@ -0,0 +1,203 @@
+/**
+ * Packed symmetric matrices and the symmetric-times-dense product (SYMM).
+ * For a block of output rows I, the product walks j in increasing order in three parts:
+ * j before I reads a contiguous slice of packed row j, j inside I reads the diagonal block,
+ * and j after I reads contiguous tails of the packed rows of I. Every output element is
+ * therefore summed over j = 0 .. n-1 in order, exactly like a dense row-by-column product,
+ * independent of the block size and of the number of threads.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "symmat.h"
+#include "threadpool.h"
+#include "utils.h"
+#include "mapped.h"
+#include "profile.h"
+
+#define SYMM_BLOCK 64 /* output rows per block */
+
+SymMatrix* allocate_sym_matrix(int n){
+  SymMatrix *S;
+  size_t count;
+  if (n < 0) {
+    return NULL;
+  }
+  count = SYM_OFFSET(n, n);
+  if (count > ((size_t)-1 - MATRIX_ALIGNMENT) / sizeof(double)) {
+    return NULL; /* Error: size overflow */
+  }
+  S = (SymMatrix *)malloc(sizeof(SymMatrix));
+  if (S == NULL) {
+    return NULL;
+  }
+  S->n = n;
+  S->data = (double *)allocate_aligned((count > 0 ? count : 1) * sizeof(double), &S->block);
+  if (S->data == NULL) {
+    free(S);
+    return NULL;
+  }
+  memset(S->data, 0, count * sizeof(double));
+  S->mapped = 0;
+  profile_allocation((double)count * sizeof(double));
+  return S;
+}
+
+/* Same as allocate_sym_matrix, with the packed triangle in a scratch file mapping (see mapped.h) */
+SymMatrix* allocate_sym_matrix_mapped(int n, const char *dir){
+  SymMatrix *S;
+  size_t count;
+  if (n < 0) {
+    return NULL;
+  }
+  count = SYM_OFFSET(n, n);
+  if (count > (size_t)-1 / sizeof(double)) {
+    return NULL; /* Error: size overflow */
+  }
+  S = (SymMatrix *)malloc(sizeof(SymMatrix));
+  if (S == NULL) {
+    return NULL;
+  }
+  S->n = n;
+  S->mapped = (count > 0) ? count * sizeof(double) : 1;
+  S->block = map_scratch(count * sizeof(double), dir);
+  if (S->block == NULL) {
+    free(S);
+    return NULL;
+  }
+  S->data = (double *)S->block;
+  return S;
+}
+
+void free_sym_matrix(SymMatrix *S){
+  if (S != NULL) {
+    if (S->mapped == 0) {
+      profile_allocation(-(double)SYM_OFFSET(S->n, S->n) * sizeof(double));
+    }
+    release_block(S->block, S->mapped);
+    free(S);
+  }
+}
+
+double sym_get(const SymMatrix *S, int i, int j){
+  return (i <= j) ? SYM_ROW(S, i)[j - i] : SYM_ROW(S, j)[i - j];
+}
+
+/* c_row += weight * b_row */
+static void axpy_row(double *c_row, double weight, const double *b_row, int k){
+  int c;
+  for (c = 0; c < k; c++) {
+    c_row[c] += weight * b_row[c];
+  }
+}
+
+typedef struct {
+    Matrix *C;
+    SymMatrix *S;
+    Matrix *B;
+} SymmJob;
+
+static void symm_task(void *context, int begin, int end, int worker){
+  SymmJob *job = (SymmJob *)context;
+  SymMatrix *S = job->S;
+  Matrix *B = job->B, *C = job->C;
+  int block, first, last, i, j, k = B->cols, n = S->n;
+  const double *packed;
+  (void)worker;
+  for (block = begin; block < end; block++) {
+    first = block * SYMM_BLOCK;
+    last = (first + SYMM_BLOCK < n) ? first + SYMM_BLOCK : n;
+    for (i = first; i < last; i++) {
+      memset(MAT_ROW(C, i), 0, (size_t)k * sizeof(double));
+    }
+    /* j < first: column slice of packed row j */
+    for (j = 0; j < first; j++) {
+      packed = SYM_ROW(S, j) + (first - j);
+      for (i = first; i < last; i++) {
+        axpy_row(MAT_ROW(C, i), packed[i - first], MAT_ROW(B, j), k);
+      }
+    }
+    /* first <= j < last: the diagonal block */
+    for (j = first; j < last; j++) {
+      for (i = first; i < last; i++) {
+        axpy_row(MAT_ROW(C, i), sym_get(S, i, j), MAT_ROW(B, j), k);
+      }
+    }
+    /* j >= last: tail of packed row i */
+    for (i = first; i < last; i++) {
+      packed = SYM_ROW(S, i) - i;
+      for (j = last; j < n; j++) {
+        axpy_row(MAT_ROW(C, i), packed[j], MAT_ROW(B, j), k);
+      }
+    }
+  }
+}
+
+int sym_matrix_mul_into(Matrix *C, SymMatrix *S, Matrix *B){
+  SymmJob job;
+  if (C == NULL || S == NULL || B == NULL || B->rows != S->n ||
+      C->rows != S->n || C->cols != B->cols || C == B) {
+    return -1; /* Error: matrices cannot be multiplied */
+  }
+  profile_product(PRODUCT_PACKED, 2.0 * S->n * S->n * B->cols,
+                  ((double)SYM_OFFSET(S->n, S->n) + 2.0 * S->n * B->cols) * sizeof(double));
+  job.C = C;
+  job.S = S;
+  job.B = B;
+  parallel_for((S->n + SYMM_BLOCK - 1) / SYMM_BLOCK, 1, symm_task, &job);
+  return 0;
+}
+
+Matrix* sym_matrix_mul(SymMatrix *S, Matrix *B){
+  Matrix *C;
+  if (S == NULL || B == NULL) {
+    return NULL;
+  }
+  C = allocate_matrix(S->n, B->cols);
+  if (C == NULL) {
+    return NULL; /* Error: memory allocation failed */
+  }
+  if (sym_matrix_mul_into(C, S, B) != 0) {
+    free_matrix(C);
+    return NULL;
+  }
+  return C;
+}
+
+SymMatrix* dense_to_sym(Matrix *A){
+  SymMatrix *S;
+  int i;
+  if (A == NULL || A->rows != A->cols) {
+    return NULL;
+  }
+  S = allocate_sym_matrix(A->rows);
+  if (S == NULL) {
+    return NULL;
+  }
+  for (i = 0; i < A->rows; i++) {
+    memcpy(SYM_ROW(S, i), MAT_ROW(A, i) + i, (size_t)(A->cols - i) * sizeof(double));
+  }
+  return S;
+}
+
+Matrix* sym_to_dense(SymMatrix *S){
+  Matrix *A;
+  int i, j;
+  if (S == NULL) {
+    return NULL;
+  }
+  A = allocate_matrix(S->n, S->n);
+  if (A == NULL) {
+    return NULL;
+  }
+  for (i = 0; i < S->n; i++) {
+    for (j = 0; j < S->n; j++) {
+      MAT_ROW(A, i)[j] = sym_get(S, i, j);
+    }
+  }
+  return A;
+}
+
+void print_sym_matrix(SymMatrix *S){
+  write_sym_matrix(stdout, S, FORMAT_TEXT);
+}
@@ -0,0 +1,39 @@
+/**
+ * This header file defines `SymMatrix`, a symmetric matrix stored as its packed upper
+ * triangle, and declares functions for allocating, converting, printing and multiplying it.
+ * Packing halves the memory of the n x n similarity and normalized matrices.
+ */
+
+#ifndef SYMMAT_H
+#define SYMMAT_H
+
+#include <stddef.h>
+#include "mat_utils.h"
+
+/**
+ * This structure holds the upper triangle (diagonal included) of an n x n symmetric matrix,
+ * row by row: packed row i holds elements (i, i), (i, i + 1), ..., (i, n - 1).
+ */
+typedef struct {
+    double *data;
+    int n;
+    void *block; /* raw allocation backing `data`, released by free_sym_matrix */
+    size_t mapped; /* length of the file mapping at `block`, 0 if block is heap memory */
+} SymMatrix;
+
+/* Offset of element (i, i) in the packed buffer */
+#define SYM_OFFSET(n, i) ((size_t)(i) * (2 * (size_t)(n) - (size_t)(i) + 1) / 2)
+/* Pointer to element (i, i); element (i, j) for j >= i is SYM_ROW(S, i)[j - i] */
+#define SYM_ROW(S, i) ((S)->data + SYM_OFFSET((S)->n, (i)))
+
+SymMatrix* allocate_sym_matrix(int n); /* elements are zero-initialized */
+SymMatrix* allocate_sym_matrix_mapped(int n, const char *dir); /* zeroed, backed by a scratch file in dir */
+void free_sym_matrix(SymMatrix *S);
+double sym_get(const SymMatrix *S, int i, int j);
+int sym_matrix_mul_into(Matrix *C, SymMatrix *S, Matrix *B); /* C = S * B, 0 on success */
+Matrix* sym_matrix_mul(SymMatrix *S, Matrix *B);
+SymMatrix* dense_to_sym(Matrix *A); /* keeps the upper triangle of A */
+Matrix* sym_to_dense(SymMatrix *S);
+void print_sym_matrix(SymMatrix *S);
+
+#endif
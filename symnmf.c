@@ -5,26 +5,369 @@
 #include "symnmf.h"
 #include "mat_utils.h"
 #include "utils.h"
+#include "simd.h"
+#include "gemm.h"
+#include "threadpool.h"
+#include "mapped.h"
+#include "rng.h"
+#include "sparse.h"
+#include "kdtree.h"
+#include "profile.h"
 
-#define EPSILON 0.0001
-#define MAX_ITER 300
-#define BETA 0.5
+#define EPSILON 0.0001 /* default SolverOptions.tolerance */
+#define MAX_ITER 300 /* default SolverOptions.max_iter */
+#define BETA 0.5 /* default SolverOptions.beta */
+#define ROW_GRAIN 16 /* rows per parallel_for chunk in the O(n^2) kernels */
+#define REDUCTION_BLOCK 256 /* rows summed together before partial sums are combined */
+#define DEFAULT_SEED 1234 /* the seed symnmf.py uses */
+#define PAIRWISE_BLOCK 128 /* NumPy's pairwise summation block size */
+#define PAIRWISE_LANES 8 /* NumPy's pairwise summation accumulators */
+#define GEMM_DISTANCE_DIMS 32 /* from this many coordinates on, sym(X) gets distances from GEMM */
+#define DISTANCE_BLOCK 64 /* rows of sym(X) per GEMM distance tile */
+#define DISTANCE_PANEL 4096 /* columns per GEMM distance tile, so a tile stays 2 MB whatever n is */
+#define AMU_MOMENTUM 0.8 /* SOLVER_AMU: initial extrapolation weight */
+#define AMU_SHRINK 1.5 /* the weight is divided by this after an objective increase */
+#define AMU_GROW 1.05 /* and multiplied by this after a decrease, up to its cap */
+#define AMU_CAP_GROW 1.005 /* the cap grows by this after a decrease, up to 1 */
+#define AMU_DAMPING_GROW 1.1 /* the damping grows by this after a decrease, from beta up to 1 */
+#define AMU_FLOOR 1e-16 /* extrapolated entries are projected onto [AMU_FLOOR, inf) */
 
 /* Function to calculate Squared Euclidean distance between two cord vectors */
 double squared_euclidean_distance(double *x, double *y, int d) {
-  double sum = 0.0;
+  return simd_kernels()->squared_distance(x, y, (size_t)d);
+}
+
+/**
+ * y[j] = exp(y[j]) for a row of exponents: the whole row goes through the vectorized exp
+ * kernel when fast is set (see EXP_TILE_MAX_ULP), else each element through libm.
+ */
+static void exp_in_place(double *y, int n, int fast){
+  int j;
+  if (fast) {
+    simd_kernels()->exp_tile(y, y, (size_t)(n > 0 ? n : 0));
+    return;
+  }
+  for (j = 0; j < n; j++) {
+    y[j] = exp(y[j]);
+  }
+}
+
+/* The kernel settings of a GraphOptions, resolved for one computation over X */
+typedef struct {
+    int family; /* KERNEL_GAUSSIAN, KERNEL_LAPLACIAN or KERNEL_CAUCHY */
+    int fast_exp;
+    double inv_scale; /* 1 / sigma^2 */
+    double *inv_sigma; /* local scaling: 1 / sigma_i per point, else NULL */
+    void *block;
+} Kernel;
+
+static int local_scales(Matrix *X, int k, double fallback, double *inv_sigma);
+
+/* Fills kernel from graph (NULL for the defaults), 0 on success; free with release_kernel */
+static int prepare_kernel(Kernel *kernel, Matrix *X, const GraphOptions *graph){
+  double sigma = (graph != NULL && graph->sigma > 0) ? graph->sigma : 1;
+  kernel->family = (graph != NULL) ? graph->kernel : KERNEL_GAUSSIAN;
+  kernel->fast_exp = (graph != NULL) && graph->fast_exp;
+  kernel->inv_scale = 1 / (sigma * sigma);
+  kernel->inv_sigma = NULL;
+  kernel->block = NULL;
+  if (kernel->family < KERNEL_GAUSSIAN || kernel->family > KERNEL_CAUCHY ||
+      (graph != NULL && (graph->sigma < 0 || graph->local_scaling < 0))){
+    return -1;
+  }
+  if (graph == NULL || graph->local_scaling == 0){
+    return 0;
+  }
+  kernel->inv_sigma = (double *)allocate_aligned((size_t)X->rows * sizeof(double), &kernel->block);
+  if (kernel->inv_sigma == NULL || local_scales(X, graph->local_scaling, sigma, kernel->inv_sigma) != 0){
+    free(kernel->block);
+    kernel->block = NULL;
+    return -1;
+  }
+  return 0;
+}
+
+static void release_kernel(Kernel *kernel){
+  free(kernel->block);
+}
+
+/**
+ * Turns row[0 .. count-1], the squared distances d from point i to points first, first+1, ...,
+ * into affinities. With t = d / s^2, where s^2 is sigma^2 or, under local scaling,
+ * sigma_i * sigma_j, the families are exp(-t/2), exp(-sqrt(t)) and 1 / (1 + t); the default
+ * (Gaussian, sigma 1) is the assignment's exp(-d/2) bit for bit.
+ */
+static void kernel_row(const Kernel *kernel, int i, int first, double *row, int count){
+  const double *inv_sigma = kernel->inv_sigma;
+  double t;
+  int j;
+  for (j = 0; j < count; j++) {
+    t = row[j] * ((inv_sigma != NULL) ? inv_sigma[i] * inv_sigma[first + j] : kernel->inv_scale);
+    if (kernel->family == KERNEL_GAUSSIAN) {
+      row[j] = -t/2;
+    } else if (kernel->family == KERNEL_LAPLACIAN) {
+      row[j] = -sqrt(t);
+    } else {
+      row[j] = 1 / (1 + t);
+    }
+  }
+  if (kernel->family != KERNEL_CAUCHY) {
+    exp_in_place(row, count, kernel->fast_exp);
+  }
+}
+
+/* The affinity of points i and j at squared distance d, one pair of kernel_row (libm exp) */
+static double kernel_value(const Kernel *kernel, int i, int j, double d){
+  double t = d * ((kernel->inv_sigma != NULL) ? kernel->inv_sigma[i] * kernel->inv_sigma[j]
+                                              : kernel->inv_scale);
+  if (kernel->family == KERNEL_GAUSSIAN) {
+    return exp(-t/2);
+  }
+  if (kernel->family == KERNEL_LAPLACIAN) {
+    return exp(-sqrt(t));
+  }
+  return 1 / (1 + t);
+}
+
+/* KERNEL_* for a kernel name ("gaussian", "laplacian" or "cauchy"), -1 if unknown */
+int parse_kernel(const char *name){
+  if (strcmp(name, "gaussian") == 0) {
+    return KERNEL_GAUSSIAN;
+  }
+  if (strcmp(name, "laplacian") == 0) {
+    return KERNEL_LAPLACIAN;
+  }
+  if (strcmp(name, "cauchy") == 0) {
+    return KERNEL_CAUCHY;
+  }
+  return -1;
+}
+
+typedef struct {
+    Matrix *X;
+    Matrix *A; /* dense destination, or NULL */
+    SymMatrix *S; /* packed destination, or NULL */
+    const Kernel *kernel;
+} SymJob;
+
+/* Writes the similarity of point i to points i, i+1, ..., n-1 into out[0 .. n-1-i] */
+static void affinity_row(const SymJob *job, int i, double *out){
+  Matrix *X = job->X;
+  int j;
+  out[0] = 0;
+  for (j = i + 1; j < X->rows; j++) {
+    out[j - i] = squared_euclidean_distance(MAT_ROW(X, i), MAT_ROW(X, j), X->cols);
+  }
+  kernel_row(job->kernel, i, i + 1, out + 1, X->rows - 1 - i);
+}
+
+/* Fills the upper triangle (and zero diagonal) of rows [begin, end) of sym(X) */
+static void sym_upper_task(void *context, int begin, int end, int worker){
+  SymJob *job = (SymJob *)context;
   int i;
-  for (i = 0; i < d; i++) {
-    sum += pow(x[i] - y[i], 2);
+  (void)worker;
+  for (i = begin; i < end; i++) {
+    affinity_row(job, i, (job->A != NULL) ? MAT_ROW(job->A, i) + i : SYM_ROW(job->S, i));
   }
-  return sum;
 }
 
-/* Functions to calculate similarity matrix */
-Matrix* calc_sym(Matrix *X) {
+/* Mirrors the upper triangle into rows [begin, end) below the diagonal */
+static void sym_lower_task(void *context, int begin, int end, int worker){
+  Matrix *A = (Matrix *)context;
   int i, j;
+  double *a_row;
+  (void)worker;
+  for (i = begin; i < end; i++) {
+    a_row = MAT_ROW(A, i);
+    for (j = 0; j < i; j++) {
+      a_row[j] = MAT_ROW(A, j)[i]; /* i > j, the matrix is symetric */
+    }
+  }
+}
+
+/* Fills rows [begin, end) of sym(X) completely, both halves computed directly */
+static void sym_full_task(void *context, int begin, int end, int worker){
+  SymJob *job = (SymJob *)context;
+  double *a_row;
+  int i, j;
+  (void)worker;
+  for (i = begin; i < end; i++) {
+    a_row = MAT_ROW(job->A, i);
+    for (j = 0; j < i; j++) {
+      a_row[j] = squared_euclidean_distance(MAT_ROW(job->X, i), MAT_ROW(job->X, j), job->X->cols);
+    }
+    kernel_row(job->kernel, i, 0, a_row, i);
+    affinity_row(job, i, a_row + i);
+  }
+}
+
+typedef struct {
+    SymJob *job;
+    Matrix *centered; /* X minus its column means */
+    int full; /* 1: whole rows (dense A only), 0: upper triangle */
+    double *norms; /* ||x_i||^2 of the centered points */
+    double **tiles; /* per worker: a DISTANCE_BLOCK x DISTANCE_PANEL tile, then gemm_serial space */
+    size_t tile_size; /* doubles of the tile part */
+} GemmSymJob;
+
+/* The row pointer of row i of sym(X) in the job's destination, indexed by column */
+static double* sym_out_row(const SymJob *job, int i){
+  return (job->A != NULL) ? MAT_ROW(job->A, i) : SYM_ROW(job->S, i) - i;
+}
+
+/**
+ * Rows [begin, end) blocks of sym(X) from the expansion ||x_i||^2 + ||x_j||^2 - 2 <x_i, x_j>:
+ * the inner products of a block of rows with a panel of later (or all) rows are one GEMM,
+ * which does the d-long work at full FLOP rate, followed by a pass of exps over each row
+ * segment. The GEMM runs serially on this worker, packing into the worker's own buffer.
+ * The points are centered first, since the expansion cancels to the distances from norms
+ * that grow with the distance from the origin. Round-off can still make it slightly
+ * negative for near-duplicate points, so it is clamped at zero.
+ */
+static void sym_gemm_task(void *context, int begin, int end, int worker){
+  GemmSymJob *gemm_job = (GemmSymJob *)context;
+  SymJob *job = gemm_job->job;
+  Matrix *X = gemm_job->centered;
+  double *tile = gemm_job->tiles[worker], *out, *g_row, d;
+  int block, first, last, column, width, start, i, j, n = X->rows;
+  for (block = begin; block < end; block++) {
+    first = block * DISTANCE_BLOCK;
+    last = (first + DISTANCE_BLOCK < n) ? first + DISTANCE_BLOCK : n;
+    for (column = gemm_job->full ? 0 : first; column < n; column += DISTANCE_PANEL) {
+      width = (n - column < DISTANCE_PANEL) ? n - column : DISTANCE_PANEL;
+      gemm_serial(last - first, width, X->cols, MAT_ROW(X, first), X->stride, NOT_TRANSPOSED,
+                  MAT_ROW(X, column), X->stride, TRANSPOSED, tile, width, tile + gemm_job->tile_size);
+      for (i = first; i < last; i++) {
+        g_row = tile + (size_t)(i - first) * (size_t)width - column; /* indexed by column */
+        out = sym_out_row(job, i);
+        start = (gemm_job->full || i < column) ? column : i;
+        for (j = start; j < column + width; j++) {
+          d = gemm_job->norms[i] + gemm_job->norms[j] - 2 * g_row[j];
+          out[j] = (d > 0) ? d : 0;
+        }
+        if (start < column + width) {
+          kernel_row(job->kernel, i, start, out + start, column + width - start);
+        }
+      }
+    }
+    for (i = first; i < last; i++) {
+      sym_out_row(job, i)[i] = 0;
+    }
+  }
+}
+
+/* Copies X minus its column means into C (same shape); distances do not change under translation */
+static void center_points(Matrix *C, Matrix *X){
+  double *mean = MAT_ROW(C, 0); /* row 0 holds the sums until it is written */
+  int i, c;
+  memset(mean, 0, (size_t)X->cols * sizeof(double));
+  for (i = 0; i < X->rows; i++) {
+    for (c = 0; c < X->cols; c++) {
+      mean[c] += MAT_ROW(X, i)[c];
+    }
+  }
+  for (c = 0; c < X->cols; c++) {
+    mean[c] /= X->rows;
+  }
+  for (i = X->rows - 1; i >= 0; i--) { /* row 0, the means, last */
+    for (c = 0; c < X->cols; c++) {
+      MAT_ROW(C, i)[c] = MAT_ROW(X, i)[c] - mean[c];
+    }
+  }
+}
+
+/* Fills sym(X) through sym_gemm_task (upper triangle, or whole rows if full); 0 on success */
+static int sym_by_gemm(SymJob *job, int full){
+  GemmSymJob gemm_job;
+  void *norms_block, **tile_blocks;
+  int c, i, rows, width, workers = threadpool_size(), status = 0, n = job->X->rows, d = job->X->cols;
+  int panel = (n < DISTANCE_PANEL) ? n : DISTANCE_PANEL;
+  gemm_job.job = job;
+  gemm_job.full = full;
+  gemm_job.centered = allocate_matrix(n, d);
+  gemm_job.norms = (double *)allocate_aligned((size_t)n * sizeof(double), &norms_block);
+  gemm_job.tiles = (double **)calloc((size_t)workers, sizeof(double *));
+  gemm_job.tile_size = (size_t)DISTANCE_BLOCK * (size_t)panel;
+  tile_blocks = (void **)calloc((size_t)workers, sizeof(void *));
+  if (gemm_job.centered == NULL || gemm_job.norms == NULL || gemm_job.tiles == NULL ||
+      tile_blocks == NULL) {
+    status = -1;
+  }
+  for (i = 0; status == 0 && i < workers; i++) {
+    gemm_job.tiles[i] = (double *)allocate_aligned((gemm_job.tile_size + gemm_pack_size(panel, d)) *
+                                                   sizeof(double), &tile_blocks[i]);
+    if (gemm_job.tiles[i] == NULL) {
+      status = -1;
+    }
+  }
+  if (status == 0) {
+    center_points(gemm_job.centered, job->X);
+  }
+  for (i = 0; status == 0 && i < n; i++) {
+    gemm_job.norms[i] = 0.0;
+    for (c = 0; c < d; c++) {
+      gemm_job.norms[i] += MAT_ROW(gemm_job.centered, i)[c] * MAT_ROW(gemm_job.centered, i)[c];
+    }
+  }
+  for (i = 0; status == 0 && i < n; i += DISTANCE_BLOCK) { /* the tile GEMMs of sym_gemm_task */
+    rows = (n - i < DISTANCE_BLOCK) ? n - i : DISTANCE_BLOCK;
+    width = full ? n : n - i;
+    profile_product(PRODUCT_DENSE, 2.0 * rows * width * d,
+                    ((double)(rows + width) * d + (double)rows * width) * sizeof(double));
+  }
+  if (status == 0) {
+    parallel_for((n + DISTANCE_BLOCK - 1) / DISTANCE_BLOCK, 1, sym_gemm_task, &gemm_job);
+  }
+  for (i = 0; tile_blocks != NULL && i < workers; i++) {
+    free(tile_blocks[i]);
+  }
+  free(tile_blocks);
+  free(gemm_job.tiles);
+  free(norms_block);
+  free_matrix(gemm_job.centered);
+  return status;
+}
+
+/**
+ * Writes sym(X) into the n x n matrix A, returns 0 on success. In memory the lower triangle is
+ * mirrored from the upper one; when A is a file mapping (see create_matrix_file) every row is
+ * computed in full instead, so the file is written front to back rather than read column-wise,
+ * which would touch a different page per element once the matrix no longer fits in RAM.
+ * The distance is symmetric bit for bit, so both ways give the same matrix. From
+ * GEMM_DISTANCE_DIMS coordinates on, distances come from sym_by_gemm instead.
+ */
+int calc_sym_into(Matrix *A, Matrix *X, const GraphOptions *graph) {
+  SymJob job;
+  Kernel kernel;
+  ProfileMark mark;
+  int status = 0;
+  profile_start(&mark);
+  if (A == NULL || X == NULL || A->rows != X->rows || A->cols != X->rows ||
+      prepare_kernel(&kernel, X, graph) != 0){
+    return -1;
+  }
+  job.X = X;
+  job.A = A;
+  job.S = NULL;
+  job.kernel = &kernel;
+  if (X->cols >= GEMM_DISTANCE_DIMS){
+    status = sym_by_gemm(&job, A->mapped > 0);
+  } else if (A->mapped > 0){
+    parallel_for(X->rows, ROW_GRAIN, sym_full_task, &job);
+  } else {
+    parallel_for(X->rows, ROW_GRAIN, sym_upper_task, &job);
+  }
+  if (status == 0 && A->mapped == 0){
+    parallel_for(X->rows, ROW_GRAIN, sym_lower_task, A);
+  }
+  release_kernel(&kernel);
+  profile_stop(&mark, "calc_sym");
+  return status;
+}
+
+/* Functions to calculate similarity matrix */
+Matrix* calc_sym(Matrix *X, const GraphOptions *graph) {
   Matrix *A;
-  double** cords = X->cords;
   if (X == NULL){
     return NULL;
   }
@@ -32,240 +375,1736 @@ Matrix* calc_sym(Matrix *X) {
   if (A == NULL){
     return NULL;
   }
-  for (i = 0; i < X->rows; i++) {
-    for (j = 0; j < X->rows; j++) {
-      if (i == j) {
-        (A->cords)[i][j] = 0;
-      } else if (i < j){
-        (A->cords)[i][j] = exp(-squared_euclidean_distance(cords[i], cords[j], X->cols)/2);
-      } else {
-        /* i > j, the matrix is symetric */
-        (A->cords)[i][j] = (A->cords)[j][i];
-      }
-    }
+  if (calc_sym_into(A, X, graph) != 0){
+    free_matrix(A);
+    return NULL;
   }
   return A;
 }
 
-void sym(Matrix *X) {
-  Matrix *sym_mat = calc_sym(X);
-  if (sym_mat == NULL)
-  {
-    free_matrix(X);
-    error_has_occured();
+/* Writes the upper triangle of sym(X) into the packed matrix S, returns 0 on success */
+int calc_sym_packed_into(SymMatrix *S, Matrix *X, const GraphOptions *graph) {
+  SymJob job;
+  Kernel kernel;
+  ProfileMark mark;
+  int status = 0;
+  profile_start(&mark);
+  if (S == NULL || X == NULL || S->n != X->rows || prepare_kernel(&kernel, X, graph) != 0){
+    return -1;
+  }
+  job.X = X;
+  job.A = NULL;
+  job.S = S;
+  job.kernel = &kernel;
+  if (X->cols >= GEMM_DISTANCE_DIMS){
+    status = sym_by_gemm(&job, 0);
+  } else {
+    parallel_for(X->rows, ROW_GRAIN, sym_upper_task, &job);
+  }
+  release_kernel(&kernel);
+  profile_stop(&mark, "calc_sym");
+  return status;
+}
+
+/* Same as calc_sym, but only the upper triangle is computed and stored */
+SymMatrix* calc_sym_packed(Matrix *X, const GraphOptions *graph) {
+  SymMatrix *S;
+  if (X == NULL){
+    return NULL;
+  }
+  S = allocate_sym_matrix(X->rows);
+  if (S == NULL){
+    return NULL;
+  }
+  if (calc_sym_packed_into(S, X, graph) != 0){
+    free_sym_matrix(S);
+    return NULL;
   }
-  print_matrix(sym_mat);
-  free_matrix(sym_mat);
+  return S;
 }
 
+/* Command line settings given as leading "--option value" pairs */
+typedef struct {
+    int threads; /* 0: SYMNMF_THREADS or the CPU count */
+    int format; /* FORMAT_TEXT, FORMAT_BINARY or FORMAT_BINARY32 */
+    const char *output; /* --output file, NULL for stdout */
+    const char *scratch; /* directory for file-backed n x n matrices, NULL to keep them on the heap */
+    int k; /* number of clusters for the symnmf goal, 0 if not given */
+    unsigned long seed; /* seed for the initial H of the symnmf goal */
+    GraphOptions graph; /* --knn, --threshold, --exp, --kernel, --sigma, --local-scaling */
+    SolverOptions solver; /* --solver, --tol, --max-iter, --beta, --time-budget */
+    int profile; /* --profile: report phase timings and counters as JSON on stderr */
+} CliOptions;
 
+/* The packed similarity matrix of X, on the heap or in a scratch file mapping */
+static SymMatrix* goal_sym_packed(Matrix *X, CliOptions *options){
+  SymMatrix *S;
+  S = (options->scratch != NULL) ? allocate_sym_matrix_mapped(X->rows, options->scratch)
+                                 : allocate_sym_matrix(X->rows);
+  if (S != NULL && calc_sym_packed_into(S, X, &options->graph) != 0){
+    free_sym_matrix(S);
+    return NULL;
+  }
+  return S;
+}
 
-/* Function to calculate diagonal degree matrix */
-Matrix* calc_ddg(Matrix *A) {
+/* Where a goal writes its result; close with close_output */
+static FILE* open_output(CliOptions *options){
+  return (options->output != NULL) ? fopen(options->output, "wb") : stdout;
+}
+
+/* Closes the goal output, returns 0 if everything reached it */
+static int close_output(FILE *out, CliOptions *options){
+  if (out == NULL){
+    return -1;
+  }
+  if (options->output != NULL){
+    return (fclose(out) == 0) ? 0 : -1;
+  }
+  return 0;
+}
+
+/**
+ * With --output and the float64 binary format the dense matrix is computed straight into a
+ * mapping of the output file, so it never has to fit in memory; otherwise the packed matrix
+ * is computed and then written out. Like the other goals, returns 0 on success.
+ */
+int sym(Matrix *X, CliOptions *options) {
+  SymMatrix *sym_mat;
+  Matrix *A;
+  FILE *out;
+  int status;
+  if (options->output != NULL && options->format == FORMAT_BINARY){
+    A = create_matrix_file(options->output, X->rows, X->rows);
+    if (A != NULL){
+      status = calc_sym_into(A, X, &options->graph);
+      if (close_matrix_file(A) != 0){ /* flushes the mapping to the file */
+        status = -1;
+      }
+      return status;
+    }
+  }
+  sym_mat = goal_sym_packed(X, options);
+  out = open_output(options);
+  status = (sym_mat == NULL || out == NULL) ? -1 : write_sym_matrix(out, sym_mat, options->format);
+  if (close_output(out, options) != 0){
+    status = -1;
+  }
+  free_sym_matrix(sym_mat);
+  return status;
+}
+
+/* Writes the row sums of rows [begin, end) of A into the degree vector D */
+static void ddg_task(void *context, int begin, int end, int worker){
+  Matrix **operands = (Matrix **)context, *A = operands[0], *D = operands[1];
   int i, j;
-  Matrix *D;
+  const double *a_row;
+  double degree;
+  (void)worker;
+  for (i = begin; i < end; i++) {
+    a_row = MAT_ROW(A, i);
+    degree = 0.0;
+    for (j = 0; j < A->cols; j++) {
+      degree += a_row[j];
+    }
+    D->data[i] = degree;
+  }
+}
+
+/* Function to calculate the diagonal degree matrix, returned as its diagonal (an n x 1 vector) */
+Matrix* calc_ddg(Matrix *A) {
+  Matrix *D, *operands[2];
+  ProfileMark mark;
+  profile_start(&mark);
   if (A == NULL){
     return NULL;
   }
-  D = allocate_matrix(A->rows, A->rows);
+  D = allocate_matrix(A->rows, 1);
   if (D == NULL){
     return NULL;
   }
-  for (i = 0; i < A->rows; i++) {
-    for (j = 0; j < A->rows; j++) {
-      if (i != j){
-        (D->cords)[i][j] = 0;
-      }
-      (D->cords)[i][i] += (A->cords)[i][j];
-    }
+  operands[0] = A;
+  operands[1] = D;
+  parallel_for(A->rows, ROW_GRAIN * 4, ddg_task, operands);
+  profile_stop(&mark, "calc_ddg");
+  return D;
+}
+
+/* The row sums of S as an n x 1 matrix, from the parallel product S * ones; NULL on error */
+static Matrix* packed_row_sums(SymMatrix *S){
+  Matrix *ones, *sums;
+  int i;
+  ones = allocate_matrix(S->n, 1);
+  if (ones == NULL){
+    return NULL;
   }
+  for (i = 0; i < S->n; i++){
+    ones->data[i] = 1.0;
+  }
+  sums = sym_matrix_mul(S, ones);
+  free_matrix(ones);
+  return sums;
+}
+
+Matrix* calc_ddg_packed(SymMatrix *S) {
+  Matrix *D;
+  ProfileMark mark;
+  profile_start(&mark);
+  if (S == NULL){
+    return NULL;
+  }
+  D = packed_row_sums(S);
+  profile_stop(&mark, "calc_ddg");
   return D;
 }
 
-void ddg(Matrix *X) {
-    Matrix *D, *A;
-    A = calc_sym(X);
-    D = calc_ddg(A);
-    free_matrix(A);
-    if (D == NULL)
-    {
-        free_matrix(X);
-        error_has_occured();
+int ddg(Matrix *X, CliOptions *options) {
+    Matrix *D;
+    SymMatrix *A;
+    FILE *out;
+    int status;
+    A = goal_sym_packed(X, options);
+    D = calc_ddg_packed(A);
+    free_sym_matrix(A);
+    out = open_output(options);
+    status = (D == NULL || out == NULL) ? -1 : write_diagonal(out, D, options->format);
+    if (close_output(out, options) != 0){
+        status = -1;
     }
-    print_matrix(D);
     free_matrix(D);
+    return status;
 }
 
-/* Function to calculate normalized similarity matrix */
-Matrix* calc_norm(Matrix *A, Matrix *D) {
-  Matrix *first_mul, *W;
-  if ((A == NULL) || (D == NULL)){
+/* d_i^-1/2 for every degree, or 0 for isolated points; free(*block) to release */
+static double* inverse_sqrt_degrees(Matrix *D, void **block){
+  double *scale;
+  int i;
+  scale = (double *)allocate_aligned((size_t)(D->rows > 0 ? D->rows : 1) * sizeof(double), block);
+  if (scale == NULL){
     return NULL;
   }
-  diag_pow(D, -0.5);
-  first_mul = matrix_mul(D, A);
-  if (first_mul == NULL){
+  for (i = 0; i < D->rows; i++){
+    scale[i] = (D->data[i] != 0) ? pow(D->data[i], -0.5) : 0; /* To avoid dividing by 0 */
+  }
+  return scale;
+}
+
+typedef struct {
+    Matrix *A; /* source */
+    Matrix *W; /* destination, may be A itself */
+    double *scale; /* d_i^-1/2, or 0 for isolated points */
+} NormJob;
+
+/* W[i][j] = d_i^-1/2 * A[i][j] * d_j^-1/2 for rows [begin, end) */
+static void norm_task(void *context, int begin, int end, int worker){
+  NormJob *job = (NormJob *)context;
+  const double *a_row, *scale = job->scale;
+  double *w_row;
+  int i, j, n = job->A->cols;
+  (void)worker;
+  for (i = begin; i < end; i++) {
+    a_row = MAT_ROW(job->A, i);
+    w_row = MAT_ROW(job->W, i);
+    for (j = 0; j < n; j++) {
+      w_row[j] = (scale[i] * a_row[j]) * scale[j];
+    }
+  }
+}
+
+/* Scales A by D^-1/2 from both sides into W, D being the degree vector from calc_ddg */
+static int scale_by_degrees(Matrix *W, Matrix *A, Matrix *D){
+  NormJob job;
+  ProfileMark mark;
+  void *block;
+  profile_start(&mark);
+  job.scale = inverse_sqrt_degrees(D, &block);
+  if (job.scale == NULL){
+    return -1;
+  }
+  job.A = A;
+  job.W = W;
+  parallel_for(A->rows, ROW_GRAIN, norm_task, &job);
+  free(block);
+  profile_stop(&mark, "calc_norm");
+  return 0;
+}
+
+/* Function to calculate normalized similarity matrix, A and D are left unchanged */
+Matrix* calc_norm(Matrix *A, Matrix *D) {
+  Matrix *W;
+  if ((A == NULL) || (D == NULL) || (D->rows != A->rows)){
     return NULL;
   }
-  W = matrix_mul(first_mul, D);
+  W = allocate_matrix(A->rows, A->cols);
   if (W == NULL){
-    free_matrix(first_mul);
+    return NULL;
+  }
+  if (scale_by_degrees(W, A, D) != 0){
+    free_matrix(W);
     return NULL;
   }
   return W;
 }
 
-void norm(Matrix *X){
-  Matrix *W, *D, *A;
-  A = calc_sym(X);
-  if (A == NULL){
-    free_matrix(X);
-    error_has_occured();
+/* Same as calc_norm but overwrites A with W, avoiding a second n x n matrix */
+int calc_norm_in_place(Matrix *A, Matrix *D) {
+  if ((A == NULL) || (D == NULL) || (D->rows != A->rows)){
+    return -1;
   }
-  D = calc_ddg(A);
-  if (D == NULL){
-    free_matrix2(X, A);
-    error_has_occured();
+  return scale_by_degrees(A, A, D);
+}
+
+typedef struct {
+    SymMatrix *S;
+    double *scale;
+} PackedNormJob;
+
+/* Scales packed rows [begin, end) in place */
+static void packed_norm_task(void *context, int begin, int end, int worker){
+  PackedNormJob *job = (PackedNormJob *)context;
+  const double *scale = job->scale;
+  double *s_row;
+  int i, j, n = job->S->n;
+  (void)worker;
+  for (i = begin; i < end; i++) {
+    s_row = SYM_ROW(job->S, i) - i; /* indexed by column */
+    for (j = i; j < n; j++) {
+      s_row[j] = (scale[i] * s_row[j]) * scale[j];
+    }
   }
-  W = calc_norm(A, D);
-  free_matrix2(A, D);
-  if (W == NULL)
-  {
-    free_matrix(X);
-    error_has_occured();
+}
+
+/* Normalizes a packed similarity matrix in place, D being its degree vector */
+int calc_norm_packed_in_place(SymMatrix *S, Matrix *D) {
+  PackedNormJob job;
+  ProfileMark mark;
+  void *block;
+  profile_start(&mark);
+  if ((S == NULL) || (D == NULL) || (D->rows != S->n)){
+    return -1;
   }
-  print_matrix(W);
-  free_matrix(W);
+  job.scale = inverse_sqrt_degrees(D, &block);
+  if (job.scale == NULL){
+    return -1;
+  }
+  job.S = S;
+  parallel_for(S->n, ROW_GRAIN, packed_norm_task, &job);
+  free(block);
+  profile_stop(&mark, "calc_norm");
+  return 0;
 }
 
-double squared_frobenius_norm(Matrix *H, Matrix *H_next){
-  double sum = 0.0;
-  int i, j;
-  for (i = 0; i < H->rows; i++){
-    for (j = 0; j < H->cols; j++){
-      sum += pow((H_next->cords)[i][j]-(H->cords)[i][j], 2);
+typedef struct {
+    Matrix *X;
+    const Kernel *kernel; /* with threshold > 0: drop neighbors whose affinity is below it */
+    double threshold;
+    KdTree *tree; /* spatial index over X, or NULL for brute force */
+    int width; /* neighbor slots per point */
+    int *counts;
+    int *neighbors;
+    double *distances;
+} KnnJob;
+
+/* Neighbor lists of points [begin, end): the `width` nearest, then thresholded */
+static void knn_task(void *context, int begin, int end, int worker){
+  KnnJob *job = (KnnJob *)context;
+  Matrix *X = job->X;
+  int i, j, t, count, kept, *index;
+  double *distance;
+  (void)worker;
+  for (i = begin; i < end; i++) {
+    index = job->neighbors + (size_t)i * (size_t)job->width;
+    distance = job->distances + (size_t)i * (size_t)job->width;
+    if (job->tree != NULL) {
+      count = kdtree_knn(job->tree, i, job->width, index, distance);
+    } else {
+      count = 0;
+      for (j = 0; j < X->rows; j++) {
+        if (j != i) {
+          count = heap_offer(index, distance, count, job->width, j,
+                             squared_euclidean_distance(MAT_ROW(X, i), MAT_ROW(X, j), X->cols));
+        }
+      }
+    }
+    for (t = 0, kept = 0; t < count; t++) {
+      if (job->threshold <= 0 || kernel_value(job->kernel, i, index[t], distance[t]) >= job->threshold) {
+        index[kept] = index[t];
+        distance[kept++] = distance[t];
+      }
+    }
+    job->counts[i] = kept;
+  }
+}
+
+/* 1 if neighbor search over X should go through a k-d tree */
+static int use_spatial_index(Matrix *X){
+  return X->cols <= KDTREE_MAX_DIMS && X->rows > KDTREE_LEAF_SIZE;
+}
+
+/* Runs knn_task over all of X with (up to) k neighbors per point, 0 on success */
+static int find_neighbors(KnnJob *job, Matrix *X, int k){
+  size_t slots;
+  job->X = X;
+  job->tree = use_spatial_index(X) ? build_kdtree(X) : NULL; /* brute force if this fails */
+  job->width = (k < X->rows - 1) ? k : X->rows - 1;
+  slots = (size_t)X->rows * (size_t)(job->width > 0 ? job->width : 1);
+  job->counts = (int *)malloc((size_t)X->rows * sizeof(int));
+  job->neighbors = (int *)malloc(slots * sizeof(int));
+  job->distances = (double *)malloc(slots * sizeof(double));
+  if (job->counts == NULL || job->neighbors == NULL || job->distances == NULL) {
+    return -1;
+  }
+  parallel_for(X->rows, ROW_GRAIN, knn_task, job);
+  return 0;
+}
+
+static void release_neighbors(KnnJob *job){
+  free(job->counts);
+  free(job->neighbors);
+  free(job->distances);
+  free_kdtree(job->tree);
+}
+
+/**
+ * 1 / sigma_i for local scaling, sigma_i being the distance from point i to its k-th nearest
+ * neighbor (the self-tuning scale of Zelnik-Manor and Perona); a point whose k-th neighbor
+ * coincides with it gets fallback instead. 0 on success.
+ */
+static int local_scales(Matrix *X, int k, double fallback, double *inv_sigma){
+  KnnJob job;
+  double sigma;
+  int i;
+  job.kernel = NULL;
+  job.threshold = 0;
+  if (find_neighbors(&job, X, k) != 0) {
+    release_neighbors(&job);
+    return -1;
+  }
+  for (i = 0; i < X->rows; i++) {
+    /* each list is a max-heap, its root is the k-th neighbor */
+    sigma = (job.counts[i] > 0) ? sqrt(job.distances[(size_t)i * (size_t)job.width]) : 0;
+    inv_sigma[i] = 1 / ((sigma > 0) ? sigma : fallback);
+  }
+  release_neighbors(&job);
+  return 0;
+}
+
+typedef struct {
+    SparseMatrix *S;
+    const Kernel *kernel;
+} SparseKernelJob;
+
+/* Replaces the squared distances stored in rows [begin, end) of a graph by affinities */
+static void sparse_kernel_task(void *context, int begin, int end, int worker){
+  SparseKernelJob *job = (SparseKernelJob *)context;
+  SparseMatrix *S = job->S;
+  size_t p;
+  int i;
+  (void)worker;
+  for (i = begin; i < end; i++) {
+    for (p = S->row_start[i]; p < S->row_start[i + 1]; p++) {
+      S->values[p] = kernel_value(job->kernel, i, S->columns[p], S->values[p]);
     }
   }
-  return sum;
 }
 
-int check_convergence(Matrix *H, Matrix *H_next){
-  double sum = squared_frobenius_norm(H, H_next);
-  return (sum < EPSILON);
+/* Symmetrized k-nearest-neighbor graph (optionally thresholded) */
+static SparseMatrix* knn_graph(Matrix *X, const GraphOptions *graph, const Kernel *kernel){
+  KnnJob job;
+  SparseKernelJob kernel_job;
+  SparseMatrix *S = NULL;
+  job.kernel = kernel;
+  job.threshold = graph->threshold;
+  if (find_neighbors(&job, X, graph->neighbors) == 0) {
+    S = sparse_from_neighbors(X->rows, job.width, job.counts, job.neighbors, job.distances);
+  }
+  release_neighbors(&job);
+  if (S != NULL) {
+    kernel_job.S = S;
+    kernel_job.kernel = kernel;
+    parallel_for(S->n, ROW_GRAIN, sparse_kernel_task, &kernel_job);
+  }
+  return S;
 }
 
-Matrix* update_H(Matrix *H, Matrix *W){
-  Matrix *numerator, *denominator, *temp;
+typedef struct {
+    Matrix *X;
+    const Kernel *kernel;
+    double threshold;
+    KdTree *tree; /* spatial index over X, or NULL for brute force */
+    double radius; /* squared distance beyond which affinities are below the threshold */
+    SparseMatrix *S;
+    size_t *counts; /* entries per row in the counting pass */
+} ThresholdJob;
+
+/* One row of the thresholded graph as the k-d tree reports it */
+typedef struct {
+    ThresholdJob *job;
+    int i;
+    size_t out;
+} ThresholdRow;
+
+static void threshold_visit(void *context, int j, double d){
+  ThresholdRow *row = (ThresholdRow *)context;
+  SparseMatrix *S = row->job->S;
+  double a = kernel_value(row->job->kernel, row->i, j, d);
+  if (a >= row->job->threshold) {
+    if (S != NULL) {
+      S->columns[row->out] = j;
+      S->values[row->out] = a;
+    }
+    row->out++;
+  }
+}
+
+/* Counts (S == NULL) or stores the entries of rows [begin, end) of the thresholded graph */
+static void threshold_task(void *context, int begin, int end, int worker){
+  ThresholdJob *job = (ThresholdJob *)context;
+  Matrix *X = job->X;
+  SparseMatrix *S = job->S;
+  ThresholdRow row;
   int i, j;
-  double h, numer_val, denom_val;
-  Matrix *H_next = allocate_matrix(H->rows, H->cols);
-  if (H_next == NULL){
+  (void)worker;
+  row.job = job;
+  for (i = begin; i < end; i++) {
+    row.i = i;
+    row.out = (S != NULL) ? S->row_start[i] : 0;
+    if (job->tree != NULL) {
+      kdtree_radius(job->tree, i, job->radius, threshold_visit, &row);
+      if (S != NULL) { /* the tree visits points in its own order */
+        sort_neighbors(S->columns + S->row_start[i], S->values + S->row_start[i],
+                       (int)(row.out - S->row_start[i]));
+      }
+    } else {
+      for (j = 0; j < X->rows; j++) {
+        if (j != i) {
+          threshold_visit(&row, j, squared_euclidean_distance(MAT_ROW(X, i), MAT_ROW(X, j), X->cols));
+        }
+      }
+    }
+    if (S == NULL) {
+      job->counts[i] = row.out;
+    }
+  }
+}
+
+/* Largest squared distance at which an affinity can still reach threshold, a little wide */
+static double kernel_reach(const Kernel *kernel, int n, double threshold){
+  double t, min_inv_sigma;
+  int i;
+  if (kernel->family == KERNEL_GAUSSIAN) {
+    t = -2 * log(threshold);
+  } else if (kernel->family == KERNEL_LAPLACIAN) {
+    t = (threshold <= 1) ? log(threshold) * log(threshold) : -1;
+  } else {
+    t = 1 / threshold - 1;
+  }
+  if (kernel->inv_sigma == NULL) {
+    return t / kernel->inv_scale * (1 + 1e-9);
+  }
+  for (i = 1, min_inv_sigma = kernel->inv_sigma[0]; i < n; i++) {
+    min_inv_sigma = (kernel->inv_sigma[i] < min_inv_sigma) ? kernel->inv_sigma[i] : min_inv_sigma;
+  }
+  return t / (min_inv_sigma * min_inv_sigma) * (1 + 1e-9);
+}
+
+/* Graph of all pairs whose affinity reaches the threshold, built in a counting and a filling pass */
+static SparseMatrix* threshold_graph(Matrix *X, double threshold, const Kernel *kernel){
+  ThresholdJob job;
+  size_t total = 0;
+  int i;
+  job.X = X;
+  job.kernel = kernel;
+  job.threshold = threshold;
+  job.radius = kernel_reach(kernel, X->rows, threshold); /* threshold_visit decides */
+  job.tree = use_spatial_index(X) ? build_kdtree(X) : NULL;
+  job.S = NULL;
+  job.counts = (size_t *)malloc((size_t)X->rows * sizeof(size_t));
+  if (job.counts == NULL) {
+    free_kdtree(job.tree);
+    return NULL;
+  }
+  parallel_for(X->rows, ROW_GRAIN, threshold_task, &job);
+  for (i = 0; i < X->rows; i++) {
+    total += job.counts[i];
+  }
+  job.S = allocate_sparse_matrix(X->rows, total);
+  if (job.S != NULL) {
+    for (i = 0; i < X->rows; i++) {
+      job.S->row_start[i + 1] = job.S->row_start[i] + job.counts[i];
+    }
+    parallel_for(X->rows, ROW_GRAIN, threshold_task, &job);
+  }
+  free(job.counts);
+  free_kdtree(job.tree);
+  return job.S;
+}
+
+/**
+ * Sparse similarity graph of X: the symmetrized k-nearest-neighbor graph when
+ * graph->neighbors > 0, keeping only affinities of at least graph->threshold when that is
+ * positive. Entries have the same values as in calc_sym (with libm exp); the diagonal is
+ * not stored. NULL on error or when graph asks for neither limit.
+ */
+SparseMatrix* calc_sym_sparse(Matrix *X, const GraphOptions *graph){
+  SparseMatrix *S = NULL;
+  Kernel kernel;
+  ProfileMark mark;
+  profile_start(&mark);
+  if (X == NULL || graph == NULL || (graph->neighbors <= 0 && graph->threshold <= 0) ||
+      prepare_kernel(&kernel, X, graph) != 0){
     return NULL;
   }
-  
-  /* Calculate Numerator: */
-  numerator = matrix_mul(W, H);
-  if (numerator == NULL){
-    free_matrix(H_next);
+  if (graph->neighbors > 0){
+    S = knn_graph(X, graph, &kernel);
+  } else {
+    S = threshold_graph(X, graph->threshold, &kernel);
+  }
+  release_kernel(&kernel);
+  profile_stop(&mark, "calc_sym");
+  return S;
+}
+
+Matrix* calc_ddg_sparse(SparseMatrix *S){
+  Matrix *D;
+  ProfileMark mark;
+  profile_start(&mark);
+  if (S == NULL){
     return NULL;
   }
-  
-  /* Calculate Denominator: */
-  temp = matrix_mul(H, transpose(H));
-  if (temp == NULL){
-    free_matrix2(H_next, numerator);
+  D = allocate_matrix(S->n, 1);
+  if (D != NULL && sparse_row_sums(D, S) != 0){
+    free_matrix(D);
     return NULL;
   }
+  profile_stop(&mark, "calc_ddg");
+  return D;
+}
+
+typedef struct {
+    SparseMatrix *S;
+    double *scale;
+} SparseNormJob;
+
+static void sparse_norm_task(void *context, int begin, int end, int worker){
+  SparseNormJob *job = (SparseNormJob *)context;
+  const double *scale = job->scale;
+  SparseMatrix *S = job->S;
+  size_t p;
+  int i;
+  (void)worker;
+  for (i = begin; i < end; i++) {
+    for (p = S->row_start[i]; p < S->row_start[i + 1]; p++) {
+      S->values[p] = (scale[i] * S->values[p]) * scale[S->columns[p]];
+    }
+  }
+}
+
+/* Normalizes a sparse similarity graph in place, D being its degree vector */
+int calc_norm_sparse_in_place(SparseMatrix *S, Matrix *D) {
+  SparseNormJob job;
+  ProfileMark mark;
+  void *block;
+  profile_start(&mark);
+  if ((S == NULL) || (D == NULL) || (D->rows != S->n)){
+    return -1;
+  }
+  job.scale = inverse_sqrt_degrees(D, &block);
+  if (job.scale == NULL){
+    return -1;
+  }
+  job.S = S;
+  parallel_for(S->n, ROW_GRAIN, sparse_norm_task, &job);
+  free(block);
+  profile_stop(&mark, "calc_norm");
+  return 0;
+}
+
+int norm(Matrix *X, CliOptions *options){
+  Matrix *D;
+  SymMatrix *A;
+  FILE *out;
+  int status;
+  A = goal_sym_packed(X, options);
+  D = calc_ddg_packed(A);
+  if (calc_norm_packed_in_place(A, D) != 0){
+    free_matrix(D);
+    free_sym_matrix(A);
+    return -1;
+  }
+  free_matrix(D);
+  out = open_output(options);
+  status = (out == NULL) ? -1 : write_sym_matrix(out, A, options->format);
+  if (close_output(out, options) != 0){
+    status = -1;
+  }
+  free_sym_matrix(A);
+  return status;
+}
+
+/* The sym, ddg and norm goals with --knn or --threshold: the same outputs from the sparse graph */
+int sparse_graph_goal(Matrix *X, CliOptions *options, const char *goal){
+  SparseMatrix *S;
+  Matrix *D;
+  FILE *out;
+  int status = 0;
+  S = calc_sym_sparse(X, &options->graph);
+  D = (strcmp(goal, "sym") != 0) ? calc_ddg_sparse(S) : NULL;
+  if (strcmp(goal, "norm") == 0){
+    status = calc_norm_sparse_in_place(S, D);
+  }
+  out = open_output(options);
+  if (S == NULL || out == NULL || status != 0 || (strcmp(goal, "sym") != 0 && D == NULL)){
+    status = -1;
+  } else if (strcmp(goal, "ddg") == 0){
+    status = write_diagonal(out, D, options->format);
+  } else {
+    status = write_sparse_matrix(out, S, options->format);
+  }
+  if (close_output(out, options) != 0){
+    status = -1;
+  }
+  free_matrix(D);
+  free_sparse_matrix(S);
+  return status;
+}
+
+/* The matrix W the updates work with, in one of its storage forms */
+typedef struct {
+    SymMatrix *packed; /* dense W as its upper triangle, or NULL */
+    SparseMatrix *sparse; /* sparse W, or NULL */
+} Affinity;
+
+static int affinity_size(const Affinity *W){
+  return (W->packed != NULL) ? W->packed->n : W->sparse->n;
+}
 
-  denominator = matrix_mul(temp, H);
-  if (denominator == NULL){
-    free_matrix3(H_next, numerator, temp);
+/* WH = W * H with the product that matches W's storage */
+static int affinity_mul_into(Matrix *WH, const Affinity *W, Matrix *H){
+  return (W->packed != NULL) ? sym_matrix_mul_into(WH, W->packed, H)
+                             : sparse_matrix_mul_into(WH, W->sparse, H);
+}
+
+/**
+ * Buffers used by the SymNMF iterations, allocated once per run. The multiplicative updates
+ * ping-pong H between H[0] and H[1], HALS keeps its second factor in the other one and the
+ * accelerated updates keep their extrapolated point in Y;
+ * partials holds one squared-difference sum per REDUCTION_BLOCK rows.
+ * The denominator H * H^T * H is evaluated as H * (H^T * H), so besides W * H only the
+ * k x k Gram matrix is stored; its rows are formed on the fly in per-worker buffers.
+ */
+struct SymnmfWorkspace {
+    Matrix *H[2];
+    Matrix *WH; /* numerator W * H */
+    Matrix *HtH; /* k x k Gram matrix */
+    Matrix *denominators; /* one row of H * (H^T * H) per worker */
+    int current; /* index of the current iterate in H */
+    double alpha; /* SOLVER_HALS: weight of the coupling term, see solver_step */
+    Matrix *Y; /* SOLVER_AMU: the point the next update starts from, else NULL */
+    Matrix *best; /* solve with a time budget: the lowest-objective point so far, else NULL */
+    double best_objective; /* its shifted_objective, HUGE_VAL before the first */
+    double objective; /* SOLVER_AMU: ||W - Y Y^T||_F^2 - ||W||_F^2 at the last Y */
+    double momentum; /* SOLVER_AMU: extrapolation weight, see accelerate */
+    double momentum_cap;
+    double beta; /* damping of the multiplicative rule, BETA unless the options set it */
+    double damping; /* SOLVER_AMU: the adaptive beta, from beta up to 1 */
+    double *gram_scratch;
+    double *partials;
+    void *gram_block;
+    void *partials_block;
+};
+
+void free_symnmf_workspace(SymnmfWorkspace *ws){
+  if (ws != NULL){
+    free_matrix3(ws->H[0], ws->H[1], ws->WH);
+    free_matrix3(ws->HtH, ws->denominators, ws->Y);
+    free_matrix(ws->best);
+    free(ws->gram_block);
+    free(ws->partials_block);
+    free(ws);
+  }
+}
+
+SymnmfWorkspace* allocate_symnmf_workspace(int n, int k){
+  int blocks = (n + REDUCTION_BLOCK - 1) / REDUCTION_BLOCK;
+  SymnmfWorkspace *ws = (SymnmfWorkspace *)calloc(1, sizeof(SymnmfWorkspace));
+  if (ws == NULL){
     return NULL;
   }
-  free_matrix(temp);
-  
-  /* update H: */
-  for (i = 0; i < H->rows; i++){
-    for (j = 0; j < H->cols; j++){
-      h = (H->cords)[i][j];
-      numer_val = (numerator->cords)[i][j];
-      denom_val = (denominator->cords)[i][j];
-      (H_next->cords)[i][j] = h*(1-BETA+BETA*(numer_val/denom_val));
+  ws->beta = BETA;
+  ws->H[0] = allocate_matrix(n, k);
+  ws->H[1] = allocate_matrix(n, k);
+  ws->WH = allocate_matrix(n, k);
+  ws->HtH = allocate_matrix(k, k);
+  ws->denominators = allocate_matrix(threadpool_size(), k);
+  ws->gram_scratch = (double *)allocate_aligned(gram_scratch_size(n, k) * sizeof(double), &ws->gram_block);
+  ws->partials = (double *)allocate_aligned((size_t)(blocks > 0 ? blocks : 1) * sizeof(double),
+                                            &ws->partials_block);
+  if (ws->H[0] == NULL || ws->H[1] == NULL || ws->WH == NULL || ws->HtH == NULL ||
+      ws->denominators == NULL || ws->gram_scratch == NULL || ws->partials == NULL){
+    free_symnmf_workspace(ws);
+    return NULL;
+  }
+  return ws;
+}
+
+int check_convergence(double squared_difference, double tolerance){
+  profile_iteration(squared_difference);
+  return (squared_difference < tolerance);
+}
+
+typedef struct {
+    Matrix *H; /* the point the rule is applied to */
+    Matrix *H_next;
+    SymnmfWorkspace *ws;
+    double beta;
+    Matrix *previous; /* SOLVER_AMU: the last iterate, H being ws->Y; NULL otherwise */
+    double momentum; /* SOLVER_AMU: weight of the extrapolation into ws->Y */
+} UpdateJob;
+
+/**
+ * The accelerated part of one row: Y[c] = H_next[c] + momentum * (H_next[c] - previous[c]),
+ * projected onto [AMU_FLOOR, inf) rather than [0, inf): the multiplicative rule never moves
+ * an entry off zero, and a positive Y keeps every denominator of the next update positive.
+ * Returns the squared distance from previous to H_next.
+ */
+static double extrapolate_row(double *y, const double *next, const double *previous, int k,
+                              double momentum){
+  double step, sum = 0.0;
+  int c;
+  for (c = 0; c < k; c++){
+    step = next[c] - previous[c];
+    sum += step * step;
+    y[c] = next[c] + momentum * step;
+    if (y[c] < AMU_FLOOR){
+      y[c] = AMU_FLOOR;
     }
   }
-  free_matrix(H);
-  free_matrix(W);
-  return H_next;
+  return sum;
+}
+
+/**
+ * Applies the multiplicative rule to row blocks [begin, end) and records how much each block
+ * moved. With job->previous set, rows of H are rows of Y and the update is measured from the
+ * last iterate instead; every row of Y is replaced by the next extrapolated point once its
+ * update is done, which is safe since row i is only read by row i.
+ */
+static void update_rows_task(void *context, int begin, int end, int worker){
+  UpdateJob *job = (UpdateJob *)context;
+  const SimdKernels *kernels = simd_kernels();
+  Matrix *G = job->ws->HtH;
+  int block, i, p, c, last, k = job->H->cols;
+  double sum, moved, h_p, *denominator = MAT_ROW(job->ws->denominators, worker);
+  const double *h_row, *g_row;
+  for (block = begin; block < end; block++){
+    sum = 0.0;
+    last = (block + 1) * REDUCTION_BLOCK;
+    if (last > job->H->rows){
+      last = job->H->rows;
+    }
+    for (i = block * REDUCTION_BLOCK; i < last; i++){
+      h_row = MAT_ROW(job->H, i);
+      memset(denominator, 0, (size_t)k * sizeof(double));
+      for (p = 0; p < k; p++){ /* denominator row i = H[i] * (H^T * H) */
+        h_p = h_row[p];
+        g_row = MAT_ROW(G, p);
+        for (c = 0; c < k; c++){
+          denominator[c] += h_p * g_row[c];
+        }
+      }
+      moved = kernels->mu_update(MAT_ROW(job->H_next, i), h_row, MAT_ROW(job->ws->WH, i),
+                                 denominator, (size_t)k, job->beta);
+      if (job->previous != NULL){
+        moved = extrapolate_row(MAT_ROW(job->H, i), MAT_ROW(job->H_next, i),
+                                MAT_ROW(job->previous, i), k, job->momentum);
+      }
+      sum += moved;
+    }
+    job->ws->partials[block] = sum;
+  }
+}
+
+/* Runs update_rows_task over all rows of job->H and returns the block sums in block order */
+static double run_update(UpdateJob *job){
+  int block, blocks = (job->H->rows + REDUCTION_BLOCK - 1) / REDUCTION_BLOCK;
+  double sum = 0.0;
+  parallel_for(blocks, 1, update_rows_task, job);
+  for (block = 0; block < blocks; block++){
+    sum += job->ws->partials[block];
+  }
+  return sum;
+}
+
+/**
+ * Writes one multiplicative update of H into H_next using only workspace buffers and stores
+ * ||H_next - H||_F^2 in *squared_difference. The block sums are combined in block order,
+ * so the value does not depend on the number of threads. Returns 0 on success.
+ */
+static int update_H(Matrix *H_next, Matrix *H, const Affinity *W, SymnmfWorkspace *ws,
+                    double *squared_difference){
+  UpdateJob job;
+  if (affinity_mul_into(ws->WH, W, H) != 0 ||
+      matrix_gram_into(ws->HtH, H, ws->gram_scratch) != 0){
+    return -1;
+  }
+  job.H = H;
+  job.H_next = H_next;
+  job.ws = ws;
+  job.beta = ws->beta;
+  job.previous = NULL;
+  job.momentum = 0.0;
+  *squared_difference = run_update(&job);
+  return 0;
+}
+
+/**
+ * ||W - Y Y^T||_F^2 up to the constant ||W||_F^2, i.e. ||Y^T Y||_F^2 - 2 <Y, W Y>, from the
+ * products update_H already needs (WH = W * Y, HtH = Y^T * Y), so it costs O(n k + k^2)
+ */
+static double shifted_objective(Matrix *Y, SymnmfWorkspace *ws){
+  double gram = 0.0, cross = 0.0;
+  const double *g_row, *y_row, *wy_row;
+  int i, c, k = Y->cols;
+  for (i = 0; i < k; i++){
+    g_row = MAT_ROW(ws->HtH, i);
+    for (c = 0; c < k; c++){
+      gram += g_row[c] * g_row[c];
+    }
+  }
+  for (i = 0; i < Y->rows; i++){
+    y_row = MAT_ROW(Y, i);
+    wy_row = MAT_ROW(ws->WH, i);
+    for (c = 0; c < k; c++){
+      cross += y_row[c] * wy_row[c];
+    }
+  }
+  return gram - 2 * cross;
+}
+
+/* Copies P into ws->best, if any, when objective (P's shifted_objective) is the lowest so far */
+static void keep_if_best(SymnmfWorkspace *ws, Matrix *P, double objective){
+  int i;
+  if (ws->best == NULL || !(objective <= ws->best_objective)){
+    return;
+  }
+  for (i = 0; i < P->rows; i++){
+    memcpy(MAT_ROW(ws->best, i), MAT_ROW(P, i), (size_t)P->cols * sizeof(double));
+  }
+  ws->best_objective = objective;
+}
+
+/**
+ * Adapts the SOLVER_AMU parameters to the objective at the current Y (Ang and Gillis,
+ * "Accelerating nonnegative matrix factorization algorithms using extrapolation", 2019).
+ * After an increase the extrapolation restarts from the plain update, the weight shrinks,
+ * its cap drops to the weight that overshot and the damping falls back to ws->beta; after a
+ * decrease the weight, its cap and the damping grow a little. Returns the weight to use.
+ */
+static double accelerate(SymnmfWorkspace *ws, double objective){
+  double momentum = 0.0;
+  if (objective > ws->objective){
+    ws->momentum_cap = ws->momentum;
+    ws->momentum /= AMU_SHRINK;
+    ws->damping = ws->beta;
+  } else {
+    ws->momentum *= AMU_GROW;
+    ws->momentum = (ws->momentum < ws->momentum_cap) ? ws->momentum : ws->momentum_cap;
+    ws->momentum_cap *= AMU_CAP_GROW;
+    ws->momentum_cap = (ws->momentum_cap < 1.0) ? ws->momentum_cap : 1.0;
+    ws->damping *= AMU_DAMPING_GROW;
+    ws->damping = (ws->damping < 1.0) ? ws->damping : 1.0;
+    momentum = ws->momentum;
+  }
+  ws->objective = objective;
+  return momentum;
 }
 
-/* Function to calculate symnmf */
-Matrix* symnmf(Matrix *H, Matrix *W){
+/**
+ * One accelerated update: H_next is the multiplicative update of Y with the adaptive damping,
+ * and Y moves on to H_next extrapolated along H_next - H (see accelerate). Stores
+ * ||H_next - H||_F^2 in *squared_difference, so convergence is judged on the iterates as for
+ * SOLVER_MU; still one product with W per iteration. Returns 0 on success.
+ */
+static int accelerated_update(Matrix *H_next, Matrix *H, const Affinity *W, SymnmfWorkspace *ws,
+                              double *squared_difference){
+  UpdateJob job;
+  double objective;
+  if (affinity_mul_into(ws->WH, W, ws->Y) != 0 ||
+      matrix_gram_into(ws->HtH, ws->Y, ws->gram_scratch) != 0){
+    return -1;
+  }
+  objective = shifted_objective(ws->Y, ws);
+  keep_if_best(ws, ws->Y, objective); /* Y is non-negative too, and about to be overwritten */
+  job.momentum = accelerate(ws, objective);
+  job.H = ws->Y;
+  job.H_next = H_next;
+  job.ws = ws;
+  job.beta = ws->damping;
+  job.previous = H;
+  *squared_difference = run_update(&job);
+  return 0;
+}
+
+/**
+ * HALS's coupling weight, half the largest row sum of W. The row sums of the non-negative W
+ * bound ||W||_2 from above, so this is at least ||W||_2 / 2, the weight from which every
+ * critical point of the relaxed problem has U = V (Zhu et al., see solver_step). -1 on error.
+ */
+static double hals_alpha(const Affinity *W){
+  Matrix *sums;
+  double sum, max = 0.0;
+  size_t p;
   int i;
-  Matrix *H_next, *H_prev;
+  if (W->sparse != NULL){
+    for (i = 0; i < W->sparse->n; i++){
+      sum = 0.0;
+      for (p = W->sparse->row_start[i]; p < W->sparse->row_start[i + 1]; p++){
+        sum += W->sparse->values[p];
+      }
+      max = (sum > max) ? sum : max;
+    }
+    return max / 2;
+  }
+  sums = packed_row_sums(W->packed);
+  if (sums == NULL){
+    return -1;
+  }
+  for (i = 0; i < sums->rows; i++){
+    max = (sums->data[i] > max) ? sums->data[i] : max;
+  }
+  free_matrix(sums);
+  return max / 2;
+}
 
-  if (H == NULL){
-    free_matrix(W);
-    error_has_occured();
-  } 
-  else if (W == NULL){
-    free_matrix(H);
-    error_has_occured();
+typedef struct {
+    Matrix *U; /* updated in place */
+    Matrix *V;
+    SymnmfWorkspace *ws; /* WH = W * V, HtH = V^T * V */
+    double alpha;
+    int gap; /* 1: also add ||U_new - V||_F^2 to the recorded sums */
+} HalsJob;
+
+/**
+ * HALS sweep over row blocks [begin, end): every U[i][j], for j = 0 .. k-1 in turn, is set to
+ * the non-negative minimizer of ||W - U V^T||^2 + alpha ||U - V||^2 in that one variable,
+ * max(0, ((W V)[i][j] + alpha V[i][j] - sum over l != j of U[i][l] (V^T V)[l][j]) /
+ * ((V^T V)[j][j] + alpha)). The objective separates over the rows of U, so rows are
+ * independent and every row sees the columns before j already updated, as in a column-wise
+ * sweep. Records how much each block moved, like update_rows_task, plus the gap between
+ * the factors if asked to.
+ */
+static void hals_rows_task(void *context, int begin, int end, int worker){
+  HalsJob *job = (HalsJob *)context;
+  Matrix *G = job->ws->HtH;
+  int block, i, j, l, last, k = job->U->cols;
+  double sum, value, numerator, denominator, change, *u_row;
+  const double *v_row, *wv_row, *g_row;
+  (void)worker;
+  for (block = begin; block < end; block++){
+    sum = 0.0;
+    last = (block + 1) * REDUCTION_BLOCK;
+    if (last > job->U->rows){
+      last = job->U->rows;
+    }
+    for (i = block * REDUCTION_BLOCK; i < last; i++){
+      u_row = MAT_ROW(job->U, i);
+      v_row = MAT_ROW(job->V, i);
+      wv_row = MAT_ROW(job->ws->WH, i);
+      for (j = 0; j < k; j++){
+        g_row = MAT_ROW(G, j); /* G is symmetric, so row j holds column j */
+        numerator = wv_row[j] + job->alpha * v_row[j];
+        for (l = 0; l < k; l++){
+          if (l != j){
+            numerator -= u_row[l] * g_row[l];
+          }
+        }
+        denominator = g_row[j] + job->alpha;
+        value = (numerator > 0 && denominator > 0) ? numerator / denominator : 0.0;
+        change = value - u_row[j];
+        sum += change * change;
+        u_row[j] = value;
+      }
+      for (j = 0; job->gap && j < k; j++){
+        sum += (u_row[j] - v_row[j]) * (u_row[j] - v_row[j]);
+      }
+    }
+    job->ws->partials[block] = sum;
+  }
+}
+
+/* One HALS half-step: U from V, in place; stores ||U_new - U||_F^2 (+ ||U_new - V||_F^2
+ * if gap). Returns 0 on success */
+static int hals_update(Matrix *U, Matrix *V, const Affinity *W, SymnmfWorkspace *ws, int gap,
+                       double *squared_difference){
+  HalsJob job;
+  int block, blocks = (U->rows + REDUCTION_BLOCK - 1) / REDUCTION_BLOCK;
+  double sum = 0.0;
+  if (affinity_mul_into(ws->WH, W, V) != 0 ||
+      matrix_gram_into(ws->HtH, V, ws->gram_scratch) != 0){
+    return -1;
+  }
+  job.U = U;
+  job.V = V;
+  job.ws = ws;
+  job.alpha = ws->alpha;
+  job.gap = gap;
+  parallel_for(blocks, 1, hals_rows_task, &job);
+  for (block = 0; block < blocks; block++){
+    sum += ws->partials[block];
+  }
+  *squared_difference = sum;
+  return 0;
+}
+
+/**
+ * One iteration of the selected solver on the iterate ws->H[ws->current]; stores how far the
+ * iterate moved in *squared_difference, 0 on success. Every solver forms W * H and H^T * H
+ * for the point it starts from, so with a ws->best that point goes to keep_if_best.
+ * SOLVER_MU writes the update into the other buffer and swaps, and so does SOLVER_AMU, which
+ * updates from the extrapolated point ws->Y instead (see accelerated_update). SOLVER_HALS solves the relaxed
+ * problem min ||W - U V^T||^2 + alpha ||U - V||^2 over U, V >= 0, whose solutions have U = V
+ * once alpha is large enough (Zhu et al., "Dropping symmetry for fast symmetric NMF", 2018;
+ * see hals_alpha): the other buffer holds U, and one iteration updates U from V, then V from
+ * U, each with one product with W and one Gram matrix. The iterate is V, and the squared
+ * difference also counts ||U - V||_F^2, so HALS only stops once both factors agree.
+ */
+static int solver_step(int solver, SymnmfWorkspace *ws, const Affinity *W, double *squared_difference){
+  Matrix *H = ws->H[ws->current], *other = ws->H[1 - ws->current];
+  double u_difference;
+  if (solver == SOLVER_HALS){
+    if (hals_update(other, H, W, ws, 0, &u_difference) != 0){
+      return -1;
+    }
+    if (ws->best != NULL){
+      keep_if_best(ws, H, shifted_objective(H, ws)); /* the products were of V = H */
+    }
+    return hals_update(H, other, W, ws, 1, squared_difference);
+  }
+  if (solver == SOLVER_AMU){
+    if (accelerated_update(other, H, W, ws, squared_difference) != 0){
+      return -1;
+    }
+  } else {
+    if (update_H(other, H, W, ws, squared_difference) != 0){
+      return -1;
+    }
+    if (ws->best != NULL){
+      keep_if_best(ws, H, shifted_objective(H, ws));
+    }
+  }
+  ws->current = 1 - ws->current;
+  return 0;
+}
+
+/* SOLVER_* for a solver name ("mu", "amu" or "hals"), -1 if unknown */
+int parse_solver(const char *name){
+  if (strcmp(name, "mu") == 0) {
+    return SOLVER_MU;
+  }
+  if (strcmp(name, "amu") == 0) {
+    return SOLVER_AMU;
+  }
+  if (strcmp(name, "hals") == 0) {
+    return SOLVER_HALS;
+  }
+  return -1;
+}
+
+/* SolverReport.status as a name */
+const char* solver_status_name(int status){
+  switch (status) {
+    case SOLVE_CONVERGED:
+      return "converged";
+    case SOLVE_MAX_ITER:
+      return "max_iter";
+    case SOLVE_TIME_BUDGET:
+      return "time_budget";
+    default:
+      return NULL;
+  }
+}
+
+/* Copies options (NULL for the defaults) into settings with the zeros replaced by defaults,
+ * returns 0 if the settings are valid */
+static int resolve_solver(SolverOptions *settings, const SolverOptions *options){
+  memset(settings, 0, sizeof(SolverOptions));
+  if (options != NULL){
+    *settings = *options;
+  }
+  settings->tolerance = (settings->tolerance != 0) ? settings->tolerance : EPSILON;
+  settings->max_iter = (settings->max_iter != 0) ? settings->max_iter : MAX_ITER;
+  settings->beta = (settings->beta != 0) ? settings->beta : BETA;
+  return (settings->solver == SOLVER_MU || settings->solver == SOLVER_AMU ||
+          settings->solver == SOLVER_HALS) &&
+         settings->tolerance > 0 && settings->max_iter > 0 && settings->beta > 0 &&
+         settings->beta <= 1 && settings->time_budget >= 0 ? 0 : -1;
+}
+
+/**
+ * 1 if an iteration as long as the last one, started now, would not leave time for the
+ * final evaluation in solve (one more product, which takes at most as long) within the budget
+ */
+static int out_of_time(const SolverOptions *settings, const ProfileMark *start,
+                       const ProfileMark *last, const ProfileMark *now){
+  return settings->time_budget > 0 &&
+         (now->wall - start->wall) + 2 * (now->wall - last->wall) > settings->time_budget;
+}
+
+/* Offers the final iterate H to keep_if_best, which takes its own products; 0 on success */
+static int evaluate_final(SymnmfWorkspace *ws, const Affinity *W, Matrix *H){
+  if (affinity_mul_into(ws->WH, W, H) != 0 ||
+      matrix_gram_into(ws->HtH, H, ws->gram_scratch) != 0){
+    return -1;
+  }
+  keep_if_best(ws, H, shifted_objective(H, ws));
+  return 0;
+}
+
+/**
+ * Runs the selected solver from H (options may be NULL) until it converges, runs out of
+ * iterations or out of time, the budget counting from this call. The result is the last
+ * iterate, except when the budget stops the run: then it is the iterate with the lowest
+ * objective ||W - H H^T||_F^2, as SOLVER_AMU and SOLVER_HALS (and the multiplicative
+ * updates with a large beta) need not be at their best when cut short.
+ * H and W are not modified, NULL on error.
+ */
+static Matrix* solve(Matrix *H, const Affinity *W, const SolverOptions *options){
+  SymnmfWorkspace *ws;
+  SolverOptions settings;
+  SolverReport report;
+  Matrix *result;
+  ProfileMark mark, last, now;
+  double squared_difference;
+  int i, solver;
+
+  profile_start(&mark);
+  if (H == NULL || affinity_size(W) != H->rows || resolve_solver(&settings, options) != 0){
+    return NULL;
+  }
+  solver = settings.solver;
+  ws = allocate_symnmf_workspace(H->rows, H->cols);
+  if (ws != NULL){
+    ws->best = (settings.time_budget > 0) ? allocate_matrix(H->rows, H->cols) : NULL;
+    ws->Y = (solver == SOLVER_AMU) ? allocate_matrix(H->rows, H->cols) : NULL;
+    if ((settings.time_budget > 0 && ws->best == NULL) || (solver == SOLVER_AMU && ws->Y == NULL)){
+      free_symnmf_workspace(ws);
+      ws = NULL;
+    }
+  }
+  if (ws == NULL){
+    return NULL;
   }
-  for (i=0; i < MAX_ITER; i++){
-    H_next = update_H(H, W);
-    if (H_next == NULL){
-      free_matrix(H);
-      free_matrix(W);
-      error_has_occured();
+  ws->best_objective = HUGE_VAL;
+  for (i = 0; i < H->rows; i++){
+    memcpy(MAT_ROW(ws->H[0], i), MAT_ROW(H, i), (size_t)H->cols * sizeof(double));
+    memcpy(MAT_ROW(ws->H[1], i), MAT_ROW(H, i), (size_t)H->cols * sizeof(double));
+    if (ws->Y != NULL){
+      memcpy(MAT_ROW(ws->Y, i), MAT_ROW(H, i), (size_t)H->cols * sizeof(double));
+    }
+  }
+  if (solver == SOLVER_HALS){
+    ws->alpha = hals_alpha(W);
+    if (ws->alpha < 0){
+      free_symnmf_workspace(ws);
+      return NULL;
+    }
+  }
+  ws->beta = settings.beta;
+  if (solver == SOLVER_AMU){
+    ws->objective = HUGE_VAL;
+    ws->momentum = AMU_MOMENTUM;
+    ws->momentum_cap = 1.0;
+    ws->damping = ws->beta;
+  }
+  report.status = SOLVE_MAX_ITER;
+  report.iterations = 0;
+  report.squared_difference = 0.0;
+  profile_start(&now); /* so the first iteration is only held to the time already spent */
+  for (i = 0; i < settings.max_iter; i++){
+    last = now;
+    profile_start(&now);
+    if (out_of_time(&settings, &mark, &last, &now)){
+      report.status = SOLVE_TIME_BUDGET;
+      break;
+    }
+    if (solver_step(solver, ws, W, &squared_difference) != 0){
+      free_symnmf_workspace(ws);
+      return NULL;
     }
-    if(check_convergence(H, H_next)){
-      free_matrix(H);
+    report.iterations++;
+    report.squared_difference = squared_difference;
+    if (check_convergence(squared_difference, settings.tolerance)){
+      report.status = SOLVE_CONVERGED;
       break;
     }
-    H_prev = H;
-    H = H_next;
-    free_matrix(H_prev);
   }
-  return H_next;
+  if (report.status == SOLVE_TIME_BUDGET && report.iterations > 0 &&
+      evaluate_final(ws, W, ws->H[ws->current]) != 0){
+    free_symnmf_workspace(ws);
+    return NULL;
+  }
+  if (settings.report != NULL){
+    *settings.report = report;
+  }
+  profile_solver_status(solver_status_name(report.status));
+  if (report.status == SOLVE_TIME_BUDGET && report.iterations > 0){
+    result = ws->best;
+    ws->best = NULL; /* hand the best point to the caller */
+  } else {
+    result = ws->H[ws->current];
+    ws->H[ws->current] = NULL; /* hand the final iterate to the caller */
+  }
+  free_symnmf_workspace(ws);
+  profile_stop(&mark, "symnmf");
+  return result;
+}
+
+/**
+ * One update of H into H_next (a different matrix) using the buffers of ws, from
+ * allocate_symnmf_workspace for the same n and k; for benchmarks, 0 on success
+ */
+int symnmf_step(Matrix *H_next, Matrix *H, SymMatrix *W, SymnmfWorkspace *ws,
+                double *squared_difference){
+  Affinity affinity;
+  if (H == NULL || H_next == NULL || W == NULL || ws == NULL || W->n != H->rows ||
+      H_next->rows != H->rows || H_next->cols != H->cols ||
+      ws->WH->rows != H->rows || ws->WH->cols != H->cols){
+    return -1;
+  }
+  affinity.packed = W;
+  affinity.sparse = NULL;
+  return update_H(H_next, H, &affinity, ws, squared_difference);
+}
+
+/**
+ * Function to calculate symnmf with the solver from options (NULL for the multiplicative
+ * updates). H and W are not modified; the result is a new matrix, NULL on error
+ */
+Matrix* symnmf(Matrix *H, SymMatrix *W, const SolverOptions *solver){
+  Affinity affinity;
+  affinity.packed = W;
+  affinity.sparse = NULL;
+  return (W != NULL) ? solve(H, &affinity, solver) : NULL;
+}
+
+/* Same as symnmf for a sparse W */
+Matrix* symnmf_sparse(Matrix *H, SparseMatrix *W, const SolverOptions *solver){
+  Affinity affinity;
+  affinity.packed = NULL;
+  affinity.sparse = W;
+  return (W != NULL) ? solve(H, &affinity, solver) : NULL;
+}
+
+/* Copies flattened (row-major) elements [first, first + count) of the dense form of S into out */
+static void packed_flat_elements(const SymMatrix *S, size_t first, size_t count, double *out){
+  size_t t, n = (size_t)S->n, i = first / n, j = first % n;
+  for (t = 0; t < count; t++) {
+    out[t] = sym_get(S, (int)i, (int)j);
+    if (++j == n) {
+      j = 0;
+      i++;
+    }
+  }
+}
+
+/**
+ * Sum of flattened elements [first, first + count) of the dense form of S, added up in exactly
+ * the order NumPy's pairwise summation uses, so mean(W) matches np.mean(W) bit for bit.
+ */
+static double pairwise_sum(const SymMatrix *S, size_t first, size_t count){
+  double values[PAIRWISE_BLOCK], lanes[PAIRWISE_LANES], sum = 0.0;
+  size_t i, half;
+  int lane;
+  if (count > PAIRWISE_BLOCK) {
+    half = count / 2;
+    half -= half % PAIRWISE_LANES;
+    return pairwise_sum(S, first, half) + pairwise_sum(S, first + half, count - half);
+  }
+  packed_flat_elements(S, first, count, values);
+  if (count < PAIRWISE_LANES) {
+    for (i = 0; i < count; i++) {
+      sum += values[i];
+    }
+    return sum;
+  }
+  for (lane = 0; lane < PAIRWISE_LANES; lane++) {
+    lanes[lane] = values[lane];
+  }
+  for (i = PAIRWISE_LANES; i < count - count % PAIRWISE_LANES; i += PAIRWISE_LANES) {
+    for (lane = 0; lane < PAIRWISE_LANES; lane++) {
+      lanes[lane] += values[i + lane];
+    }
+  }
+  sum = ((lanes[0] + lanes[1]) + (lanes[2] + lanes[3])) + ((lanes[4] + lanes[5]) + (lanes[6] + lanes[7]));
+  for (; i < count; i++) {
+    sum += values[i];
+  }
+  return sum;
+}
+
+/* n x k values uniform on [0, 2 * sqrt(mean / k)), drawn row by row like np.random.uniform */
+static Matrix* random_H(int n, int k, double mean, unsigned long seed){
+  Matrix *H;
+  Rng rng;
+  double scale;
+  int i, j;
+  H = allocate_matrix(n, k);
+  if (H == NULL){
+    return NULL;
+  }
+  scale = 2 * sqrt(mean / k);
+  rng_seed(&rng, seed);
+  for (i = 0; i < n; i++){
+    for (j = 0; j < k; j++){
+      MAT_ROW(H, i)[j] = rng_uniform(&rng) * scale;
+    }
+  }
+  return H;
+}
+
+/**
+ * The initial H of the pipeline (and so of symnmf.py): n x k values uniform on
+ * [0, 2 * sqrt(mean(W) / k)), drawn row by row from an MT19937 seeded like
+ * np.random.seed(seed). NULL on error.
+ */
+Matrix* initialize_H(SymMatrix *W, int k, unsigned long seed){
+  Matrix *H;
+  ProfileMark mark;
+  if (W == NULL || W->n < 1 || k < 1){
+    return NULL;
+  }
+  profile_start(&mark);
+  H = random_H(W->n, k, pairwise_sum(W, 0, (size_t)W->n * (size_t)W->n) / ((double)W->n * (double)W->n), seed);
+  profile_stop(&mark, "initialize_H");
+  return H;
+}
+
+/* Same as initialize_H for a sparse W, whose mean counts the entries that are not stored */
+Matrix* initialize_H_sparse(SparseMatrix *W, int k, unsigned long seed){
+  Matrix *H;
+  ProfileMark mark;
+  double sum = 0.0;
+  size_t p;
+  if (W == NULL || W->n < 1 || k < 1){
+    return NULL;
+  }
+  profile_start(&mark);
+  for (p = 0; p < W->nnz; p++){
+    sum += W->values[p];
+  }
+  H = random_H(W->n, k, sum / ((double)W->n * (double)W->n), seed);
+  profile_stop(&mark, "initialize_H");
+  return H;
+}
+
+/**
+ * Copies solver (NULL: the defaults) into left with time_budget reduced by the time since
+ * entry, so that a pipeline's budget covers the graph and initialization too. Returns 0
+ * when a budget was set and nothing of it is left, 1 otherwise.
+ */
+static int remaining_budget(SolverOptions *left, const SolverOptions *solver,
+                            const ProfileMark *entry){
+  ProfileMark now;
+  SolverOptions checked;
+  memset(left, 0, sizeof(*left));
+  if (solver != NULL){
+    *left = *solver;
+  }
+  if (!(left->time_budget > 0) || resolve_solver(&checked, left) != 0){
+    return 1; /* no budget, or invalid options for the solver to reject */
+  }
+  profile_start(&now);
+  left->time_budget -= now.wall - entry->wall;
+  return left->time_budget > 0;
+}
+
+/* The pipeline's result when its budget ran out before the first iteration: H itself */
+static Matrix* out_of_budget(Matrix *H, const SolverOptions *left){
+  if (left->report != NULL){
+    left->report->status = SOLVE_TIME_BUDGET;
+    left->report->iterations = 0;
+    left->report->squared_difference = 0.0;
+  }
+  profile_solver_status(solver_status_name(SOLVE_TIME_BUDGET));
+  return H;
+}
+
+/* symnmf_pipeline with W stored as a sparse graph, entry being when the pipeline started */
+static Matrix* sparse_pipeline(Matrix *X, int k, unsigned long seed, const GraphOptions *graph,
+                               const SolverOptions *solver, const ProfileMark *entry){
+  SparseMatrix *W;
+  SolverOptions left;
+  Matrix *D, *H, *result;
+  W = calc_sym_sparse(X, graph);
+  D = calc_ddg_sparse(W);
+  if (calc_norm_sparse_in_place(W, D) != 0){
+    free_matrix(D);
+    free_sparse_matrix(W);
+    return NULL;
+  }
+  free_matrix(D);
+  H = initialize_H_sparse(W, k, seed);
+  if (!remaining_budget(&left, solver, entry) && H != NULL){
+    result = out_of_budget(H, &left);
+  } else {
+    result = symnmf_sparse(H, W, &left);
+    free_matrix(H);
+  }
+  free_sparse_matrix(W);
+  return result;
+}
+
+/**
+ * The whole algorithm on the points X: W = norm(sym(X)), H from initialize_H, then the
+ * solver from solver. W is packed, or sparse when graph asks for a neighbor or threshold
+ * limit (graph and solver may be NULL). Only X and the n x k result cross the caller's boundary.
+ * A time budget counts from this call, so the graph and initialization spend it too.
+ * Returns the final H, NULL on error.
+ */
+Matrix* symnmf_pipeline(Matrix *X, int k, unsigned long seed, const GraphOptions *graph,
+                        const SolverOptions *solver){
+  ProfileMark entry;
+  SymMatrix *W;
+  SolverOptions left;
+  Matrix *D, *H, *result;
+  profile_start(&entry);
+  if (X == NULL || k < 1 || k >= X->rows){
+    return NULL;
+  }
+  if (graph != NULL && (graph->neighbors > 0 || graph->threshold > 0)){
+    return sparse_pipeline(X, k, seed, graph, solver, &entry);
+  }
+  W = calc_sym_packed(X, graph);
+  D = calc_ddg_packed(W);
+  if (calc_norm_packed_in_place(W, D) != 0){
+    free_matrix(D);
+    free_sym_matrix(W);
+    return NULL;
+  }
+  free_matrix(D);
+  H = initialize_H(W, k, seed);
+  if (!remaining_budget(&left, solver, &entry) && H != NULL){
+    result = out_of_budget(H, &left);
+  } else {
+    result = symnmf(H, W, &left);
+    free_matrix(H);
+  }
+  free_sym_matrix(W);
+  return result;
 }
 
-void test(Matrix* matrix){
+/* Runs symnmf_pipeline on X and writes H */
+int symnmf_goal(Matrix *X, CliOptions *options){
+  Matrix *H;
+  FILE *out;
+  int status;
+  H = symnmf_pipeline(X, options->k, options->seed, &options->graph, &options->solver);
+  out = open_output(options);
+  status = (H == NULL || out == NULL) ? -1 : write_matrix(out, H, options->format);
+  if (close_output(out, options) != 0){
+    status = -1;
+  }
+  free_matrix(H);
+  return status;
+}
+
+int test(Matrix* matrix){
   diag_pow(matrix,2);
   print_matrix(matrix);
+  return 0;
+}
+
+#ifndef SYMNMF_NO_MAIN /* set when symnmf.c is linked into another program, e.g. symnmf_bench */
+/* 1 if the goals should build a sparse similarity graph */
+static int sparse_goal(CliOptions *options){
+  return options->graph.neighbors > 0 || options->graph.threshold > 0;
+}
+
+/* Consumes leading "--option value" pairs (and the bare --profile flag), returns the index of
+ * the first positional argument or -1 if an option is unknown or malformed */
+static int parse_options(int argc, char *argv[], CliOptions *options){
+  int i = 1;
+  char *end;
+  options->threads = 0;
+  options->format = FORMAT_TEXT;
+  options->output = NULL;
+  options->scratch = getenv(SCRATCH_ENV);
+  options->k = 0;
+  options->seed = DEFAULT_SEED;
+  options->graph.neighbors = 0;
+  options->graph.threshold = 0;
+  options->graph.fast_exp = 0;
+  options->graph.kernel = KERNEL_GAUSSIAN;
+  options->graph.sigma = 0;
+  options->graph.local_scaling = 0;
+  options->solver.solver = SOLVER_MU;
+  options->solver.tolerance = 0;
+  options->solver.max_iter = 0;
+  options->solver.beta = 0;
+  options->solver.time_budget = 0;
+  options->solver.report = NULL;
+  options->profile = 0;
+  while (i < argc && strncmp(argv[i], "--", 2) == 0) {
+    if (strcmp(argv[i], "--profile") == 0) {
+      options->profile = 1;
+      i++;
+      continue;
+    }
+    if (i + 1 >= argc) {
+      return -1;
+    }
+    if (strcmp(argv[i], "--threads") == 0) {
+      options->threads = atoi(argv[i + 1]);
+      if (options->threads < 1) {
+        return -1;
+      }
+    } else if (strcmp(argv[i], "--format") == 0) {
+      options->format = parse_format(argv[i + 1]);
+      if (options->format < 0) {
+        return -1;
+      }
+    } else if (strcmp(argv[i], "--output") == 0) {
+      options->output = argv[i + 1];
+    } else if (strcmp(argv[i], "--scratch") == 0) {
+      options->scratch = argv[i + 1];
+    } else if (strcmp(argv[i], "--k") == 0) {
+      options->k = atoi(argv[i + 1]);
+      if (options->k < 1) {
+        return -1;
+      }
+    } else if (strcmp(argv[i], "--knn") == 0) {
+      options->graph.neighbors = atoi(argv[i + 1]);
+      if (options->graph.neighbors < 1) {
+        return -1;
+      }
+    } else if (strcmp(argv[i], "--threshold") == 0) {
+      options->graph.threshold = strtod(argv[i + 1], &end);
+      if (*end != '\0' || end == argv[i + 1] || !(options->graph.threshold > 0)) {
+        return -1;
+      }
+    } else if (strcmp(argv[i], "--exp") == 0) {
+      if (strcmp(argv[i + 1], "fast") != 0 && strcmp(argv[i + 1], "libm") != 0) {
+        return -1;
+      }
+      options->graph.fast_exp = (strcmp(argv[i + 1], "fast") == 0);
+    } else if (strcmp(argv[i], "--kernel") == 0) {
+      options->graph.kernel = parse_kernel(argv[i + 1]);
+      if (options->graph.kernel < 0) {
+        return -1;
+      }
+    } else if (strcmp(argv[i], "--sigma") == 0) {
+      options->graph.sigma = strtod(argv[i + 1], &end);
+      if (*end != '\0' || end == argv[i + 1] || !(options->graph.sigma > 0)) {
+        return -1;
+      }
+    } else if (strcmp(argv[i], "--local-scaling") == 0) {
+      options->graph.local_scaling = atoi(argv[i + 1]);
+      if (options->graph.local_scaling < 1) {
+        return -1;
+      }
+    } else if (strcmp(argv[i], "--solver") == 0) {
+      options->solver.solver = parse_solver(argv[i + 1]);
+      if (options->solver.solver < 0) {
+        return -1;
+      }
+    } else if (strcmp(argv[i], "--tol") == 0) {
+      options->solver.tolerance = strtod(argv[i + 1], &end);
+      if (*end != '\0' || end == argv[i + 1] || !(options->solver.tolerance > 0)) {
+        return -1;
+      }
+    } else if (strcmp(argv[i], "--max-iter") == 0) {
+      options->solver.max_iter = atoi(argv[i + 1]);
+      if (options->solver.max_iter < 1) {
+        return -1;
+      }
+    } else if (strcmp(argv[i], "--beta") == 0) {
+      options->solver.beta = strtod(argv[i + 1], &end);
+      if (*end != '\0' || end == argv[i + 1] || !(options->solver.beta > 0 && options->solver.beta <= 1)) {
+        return -1;
+      }
+    } else if (strcmp(argv[i], "--time-budget") == 0) { /* seconds from the pipeline call */
+      options->solver.time_budget = strtod(argv[i + 1], &end);
+      if (*end != '\0' || end == argv[i + 1] || !(options->solver.time_budget > 0)) {
+        return -1;
+      }
+    } else if (strcmp(argv[i], "--seed") == 0) {
+      options->seed = strtoul(argv[i + 1], &end, 10);
+      if (*end != '\0' || end == argv[i + 1] || options->seed > 0xffffffffUL) {
+        return -1;
+      }
+    } else {
+      return -1;
+    }
+    i += 2;
+  }
+  if (options->scratch != NULL && *options->scratch == '\0') {
+    options->scratch = NULL;
+  }
+  return i;
 }
 
 int main(int argc, char *argv[]) {
   Matrix *matrix;
   char *goal, *filename;
-  if (argc != 3) {
+  CliOptions options;
+  Profile profile;
+  ProfileMark mark;
+  int status = 0, first = parse_options(argc, argv, &options);
+  if (first < 0 || argc - first != 2) {
     error_has_occured();
   }
 
-  goal = argv[1];
-  filename = argv[2];
+  goal = argv[first];
+  filename = argv[first + 1];
+  threadpool_init(options.threads); /* 0 picks SYMNMF_THREADS or the CPU count */
+  if (options.profile) {
+    profile_begin(&profile);
+  }
 
+  profile_start(&mark);
   matrix = file_to_matrix(filename);
+  profile_stop(&mark, "read_input");
   if (matrix == NULL)
   {
     error_has_occured();
   }
 
-  if (strcmp(goal, "sym") == 0)
+  if (sparse_goal(&options) &&
+      (strcmp(goal, "sym") == 0 || strcmp(goal, "ddg") == 0 || strcmp(goal, "norm") == 0))
   {
-    sym(matrix);
+    status = sparse_graph_goal(matrix, &options, goal);
+  }
+  else if (strcmp(goal, "sym") == 0)
+  {
+    status = sym(matrix, &options);
   }
   else if (strcmp(goal, "ddg") == 0)
   {
-    ddg(matrix);
+    status = ddg(matrix, &options);
   }
   else if (strcmp(goal, "norm") == 0)
   {
-    norm(matrix);
+    status = norm(matrix, &options);
+  }
+  else if (strcmp(goal, "symnmf") == 0)
+  {
+    status = symnmf_goal(matrix, &options);
   }
   else if (strcmp(goal, "test") == 0)
   {
-    test(matrix);
+    status = test(matrix);
+  }
+  if (status != 0)
+  {
+    free_matrix(matrix);
+    error_has_occured(); /* the only place the program exits on an error */
   }
   free_matrix(matrix);
+  if (options.profile) { /* stdout only ever carries the result */
+    profile_end();
+    profile_write_json(stderr, &profile);
+  }
+  threadpool_shutdown();
   return 0;
-}
\ No newline at end of file
+}
+#endif
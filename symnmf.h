@@ -2,11 +2,87 @@
 #define SYMNMF_H
 
 #include "mat_utils.h"
+#include "symmat.h"
+#include "sparse.h"
 
-Matrix* calc_sym(Matrix *X);
-Matrix* calc_ddg(Matrix *A);
-Matrix* calc_norm(Matrix *A, Matrix *D);
-Matrix* symnmf(Matrix *H, Matrix *W);
+/* Kernel families; with t = ||x - y||^2 / s^2 the affinity is */
+#define KERNEL_GAUSSIAN 0 /* exp(-t/2), the default */
+#define KERNEL_LAPLACIAN 1 /* exp(-sqrt(t)) */
+#define KERNEL_CAUCHY 2 /* 1 / (1 + t) */
+
+/**
+ * How the similarity graph is built; all zero (or a NULL pointer) means the exact dense graph
+ * with the Gaussian kernel and s = 1, i.e. exp(-||x - y||^2 / 2).
+ */
+typedef struct {
+    int neighbors; /* > 0: keep each point's nearest neighbors (union, so W stays symmetric) */
+    double threshold; /* > 0: keep affinities of at least this value */
+    int fast_exp; /* 1: dense affinities use the vectorized exp (EXP_TILE_MAX_ULP) instead of libm */
+    int kernel; /* KERNEL_* */
+    double sigma; /* bandwidth s, 0 means 1 */
+    int local_scaling; /* > 0: s^2 = s_i * s_j, s_i the distance from x_i to its local_scaling-th
+                          nearest neighbor (sigma where that is 0) */
+} GraphOptions;
+
+int parse_kernel(const char *name); /* "gaussian", "laplacian" or "cauchy", -1 if unknown */
+
+/* Solvers for H, all stop once check_convergence accepts ||H_next - H||_F^2 */
+#define SOLVER_MU 0 /* damped multiplicative updates, the default */
+#define SOLVER_HALS 1 /* hierarchical alternating least squares (column-wise coordinate descent),
+                         two products with W per iteration */
+#define SOLVER_AMU 2 /* multiplicative updates with adaptive extrapolation and damping */
+
+/* How a solver run ended, SolverReport.status */
+#define SOLVE_CONVERGED 0 /* the squared difference fell below the tolerance */
+#define SOLVE_MAX_ITER 1 /* max_iter iterations ran without converging */
+#define SOLVE_TIME_BUDGET 2 /* the next iteration would not have finished within time_budget */
+
+typedef struct {
+    int status; /* SOLVE_* */
+    int iterations;
+    double squared_difference; /* of the last iteration, 0 if none ran */
+} SolverReport;
+
+/**
+ * How H is found; all zero (or a NULL pointer) means the multiplicative updates with
+ * tolerance 1e-4, at most 300 iterations, damping 0.5 and no time budget. The result is
+ * the last iterate, or the lowest-objective one when the time budget stops the run.
+ */
+typedef struct {
+    int solver; /* SOLVER_* */
+    double tolerance; /* converged once ||H_next - H||_F^2 is below this, 0 means 1e-4 */
+    int max_iter; /* 0 means 300 */
+    double beta; /* damping of the multiplicative rule, in (0, 1], 0 means 0.5 */
+    double time_budget; /* wall-clock seconds from the symnmf or pipeline call, 0 means none */
+    SolverReport *report; /* filled in when the run succeeds, may be NULL */
+} SolverOptions;
+
+int parse_solver(const char *name); /* "mu", "amu" or "hals", -1 if unknown */
+const char* solver_status_name(int status); /* "converged", "max_iter" or "time_budget" */
+
+Matrix* calc_sym(Matrix *X, const GraphOptions *graph);
+int calc_sym_into(Matrix *A, Matrix *X, const GraphOptions *graph); /* A may be a file mapping, 0 on success */
+SymMatrix* calc_sym_packed(Matrix *X, const GraphOptions *graph);
+int calc_sym_packed_into(SymMatrix *S, Matrix *X, const GraphOptions *graph);
+Matrix* calc_ddg(Matrix *A); /* degree vector (n x 1), the diagonal of D */
+Matrix* calc_norm(Matrix *A, Matrix *D); /* D is the degree vector from calc_ddg */
+int calc_norm_in_place(Matrix *A, Matrix *D); /* 0 on success */
+Matrix* calc_ddg_packed(SymMatrix *S);
+int calc_norm_packed_in_place(SymMatrix *S, Matrix *D); /* 0 on success */
+SparseMatrix* calc_sym_sparse(Matrix *X, const GraphOptions *graph);
+Matrix* calc_ddg_sparse(SparseMatrix *S);
+int calc_norm_sparse_in_place(SparseMatrix *S, Matrix *D); /* 0 on success */
+Matrix* symnmf(Matrix *H, SymMatrix *W, const SolverOptions *solver);
+typedef struct SymnmfWorkspace SymnmfWorkspace; /* the solver's preallocated buffers */
+SymnmfWorkspace* allocate_symnmf_workspace(int n, int k);
+void free_symnmf_workspace(SymnmfWorkspace *ws);
+int symnmf_step(Matrix *H_next, Matrix *H, SymMatrix *W, SymnmfWorkspace *ws,
+                double *squared_difference); /* one update */
+Matrix* symnmf_sparse(Matrix *H, SparseMatrix *W, const SolverOptions *solver);
+Matrix* initialize_H(SymMatrix *W, int k, unsigned long seed); /* seeded like np.random.seed */
+Matrix* initialize_H_sparse(SparseMatrix *W, int k, unsigned long seed);
+Matrix* symnmf_pipeline(Matrix *X, int k, unsigned long seed, const GraphOptions *graph,
+                        const SolverOptions *solver); /* X -> final H */
 
 
 #endif
\ No newline at end of file
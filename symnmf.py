@@ -1,39 +1,93 @@
-import math
 import numpy as np
 import pandas as pd
 import symnmfmodule  # This is the C extension module
 import sys
 
-
-def sym(mat):
-  return symnmfmodule.sym(mat)
-
-
-def ddg(mat):
-  return symnmfmodule.ddg(mat)
-
-
-def norm(mat):
-  return symnmfmodule.norm(mat)
-
-
-def symnmf(mat, k):
-  H, W = initialize_H(mat, k)
-  return symnmfmodule.symnmf(H, W)
-
-
-def initialize_H(mat, k):
-  # initialize W as the norm of mat and H with random values between 0 and 2*sqrt(m/k)
-  W = norm(mat)
-  m = np.mean(W)
-  H = (np.random.uniform(0, 1, (len(mat), k)) * (2 * math.sqrt(m / k))).tolist()
-  return H, W
+# Binary matrix files, same layout as the C side (see utils.h): a 32 byte header
+# ("SNMF", version, dtype, reserved, uint64 rows, uint64 cols, reserved) and then
+# little-endian row-major elements.
+BINARY_MAGIC = b"SNMF"
+BINARY_VERSION = 1
+BINARY_HEADER = np.dtype([("magic", "S4"), ("version", "u1"), ("dtype", "u1"), ("reserved", "<u2"),
+                          ("rows", "<u8"), ("cols", "<u8"), ("reserved2", "<u8")])
+BINARY_DTYPES = {1: np.dtype("<f8"), 2: np.dtype("<f4")}
+SEED = 1234
+
+
+# The similarity options, passed on to the C extension as keywords:
+#   fast_exp=True evaluates the affinities with the vectorized exp kernel instead of
+#     libm; it is a few ulps off, far below the printed precision.
+#   kernel="gaussian" | "laplacian" | "cauchy" and its bandwidth sigma=1.0 (so the data
+#     needs no rescaling in Python), or local_scaling=k to scale each pair by the
+#     distances of both points to their k-th nearest neighbors.
+#   solver="mu" | "amu" | "hals" (symnmf only) picks the multiplicative updates, the same
+#     updates accelerated by extrapolation with an adaptive step, or hierarchical
+#     alternating least squares; both alternatives usually converge in fewer iterations,
+#     but a HALS iteration costs two products with W, so it is not always faster.
+#   tol=1e-4, max_iter=300 and beta=0.5 (symnmf only) set the convergence threshold on
+#     ||H_next - H||_F^2, the iteration limit and the damping of the multiplicative rule;
+#     time_budget=seconds, counted from the call (graph construction included), stops
+#     before an iteration that would end past the budget and then returns the H with the
+#     lowest ||W - HH^T||_F^2 found so far (otherwise the last H).
+#     return_status=True returns (H, status) instead, status being "converged",
+#     "max_iter" or "time_budget".
+#   profile=True returns (result, profile) instead, profile being a dict with the
+#     wall/CPU time per phase, the solver's iterations and last convergence value, FLOP
+#     and byte counts of the matrix products, the peak bytes held in C matrices and the
+#     bytes freed with no matching allocation (nonzero points at a bookkeeping bug).
+def sym(mat, **options):
+  return symnmfmodule.sym(mat, **options)
+
+
+def ddg(mat, **options):
+  return symnmfmodule.ddg(mat, **options)
+
+
+def norm(mat, **options):
+  return symnmfmodule.norm(mat, **options)
+
+
+def symnmf(mat, k, seed=SEED, neighbors=0, threshold=0.0, **options):
+  # the whole pipeline runs in C: W and the initial H (drawn by initialize_H in
+  # symnmf.c, uniform in [0, 2*sqrt(mean(W)/k)) from a Mersenne Twister seeded with
+  # seed, like np.random.seed) never cross into Python. A positive neighbors or
+  # threshold keeps W as a sparse k-nearest-neighbor or thresholded graph.
+  return symnmfmodule.pipeline(mat, k, seed, neighbors=neighbors, threshold=threshold, **options)
+
+
+def is_binary_file(file_name):
+  with open(file_name, "rb") as f:
+    return f.read(4) == BINARY_MAGIC
+
+
+def read_binary(file_name):
+  # read a binary matrix file into a float64 array
+  header = np.fromfile(file_name, dtype=BINARY_HEADER, count=1)[0]
+  if header["version"] != BINARY_VERSION or header["dtype"] not in BINARY_DTYPES:
+    raise ValueError("unsupported binary matrix file")
+  rows, cols = int(header["rows"]), int(header["cols"])
+  data = np.fromfile(file_name, dtype=BINARY_DTYPES[int(header["dtype"])],
+                     count=rows * cols, offset=BINARY_HEADER.itemsize)
+  return data.reshape(rows, cols).astype(np.float64)
+
+
+def write_binary(stream, mat, dtype=np.float64):
+  # write mat to a binary stream in the binary matrix format, as float64 or float32
+  mat = np.asarray(mat)
+  code = 2 if np.dtype(dtype) == np.float32 else 1
+  header = np.zeros(1, dtype=BINARY_HEADER)
+  header["magic"], header["version"], header["dtype"] = BINARY_MAGIC, BINARY_VERSION, code
+  header["rows"], header["cols"] = mat.shape
+  stream.write(header.tobytes())
+  stream.write(np.ascontiguousarray(mat, dtype=BINARY_DTYPES[code]).tobytes())
 
 
 def file_to_mat(file_name):
-  # read the file and convert it to an array
-  data_mat = pd.read_csv(file_name, header=None).to_numpy().tolist()
-  return data_mat
+  # read the file (text or binary) into a C-contiguous float64 array, which the
+  # C extension uses in place without copying
+  if is_binary_file(file_name):
+    return read_binary(file_name)
+  return np.ascontiguousarray(pd.read_csv(file_name, header=None).to_numpy(dtype=np.float64))
 
 
 def print_matrix(mat):
@@ -45,37 +99,46 @@ def print_matrix(mat):
 
 def main():
   # set seed:
-  np.random.seed(1234)
-
-  # Read command line arguments
-  if len(sys.argv) != 4:
+  np.random.seed(SEED)
+
+  # Read command line arguments: [--format text|binary|binary32] k goal file
+  args = sys.argv[1:]
+  out_format = "text"
+  if len(args) >= 2 and args[0] == "--format":
+    out_format, args = args[1], args[2:]
+  if len(args) != 3 or out_format not in ("text", "binary", "binary32"):
     print("An Error Has Occurred")
     return
   
   # initializing the variables
-  k = int(sys.argv[1])
-  goal = str(sys.argv[2])
-  file_name = str(sys.argv[3])
+  k = int(args[0])
+  goal = str(args[1])
+  file_name = str(args[2])
   
   # Read data from file
   X = file_to_mat(file_name)
   
   # Action based on user goal input:   
   if (goal == 'symnmf'):
-    print_matrix(symnmf(X, k))
+    result = symnmf(X, k)
   
   elif (goal == 'sym'):
-    print_matrix(sym(X))
+    result = sym(X)
 
   elif (goal == 'ddg'):
-    print_matrix(ddg(X))
+    result = ddg(X)
 
   elif (goal == 'norm'):
-    print_matrix(norm(X))
+    result = norm(X)
 
   else:
     print("An Error Has Occurred")
     return
+
+  if out_format == "text":
+    print_matrix(result)
+  else:
+    write_binary(sys.stdout.buffer, result, np.float32 if out_format == "binary32" else np.float64)
   
 
 if __name__ == "__main__":
@@ -1,178 +1,530 @@
 #define PY_SSIZE_T_CLEAN
+#define NPY_NO_DEPRECATED_API NPY_1_7_API_VERSION
 #include <Python.h>
+#include <numpy/arrayobject.h>
 #include <stdio.h>
+#include <string.h>
 #include "symnmf.h"
+#include "profile.h"
 
-/* Convertions*/
-/* python list of lists to matrix*/
-Matrix* PyObjectToMatrix(PyObject* cords){
+#define MATRIX_CAPSULE "symnmfmodule.Matrix"
 
+/**
+ * The wrappers convert their arguments while holding the GIL, release it around the pure C
+ * computation (which keeps no global state besides the shared worker pool) and take it back
+ * to build the result, so requests running on several Python threads proceed in parallel.
+ * The input buffers stay exported, so NumPy refuses to resize them meanwhile.
+ */
+
+/* Convertions */
+/* 1 if view is a 2-D buffer of native doubles (C-contiguous is guaranteed by the request flags) */
+static int is_float64_matrix(Py_buffer *view){
+  const char *format = (view->format != NULL) ? view->format : "B";
+  if (view->ndim != 2 || view->itemsize != (Py_ssize_t)sizeof(double)) {
+    return 0;
+  }
+  if (*format == '@' || *format == '=') {
+    format++;
+  }
+  return strcmp(format, "d") == 0;
 }
 
-/* C matrix struct to python list of lists*/
-PyObject* PyObjectFromMatrix(Matrix* X){
+/* Requests a C-contiguous float64 matrix buffer from obj, returns 0 on success */
+static int get_float64_buffer(PyObject *obj, Py_buffer *view){
+  if (PyObject_GetBuffer(obj, view, PyBUF_C_CONTIGUOUS | PyBUF_FORMAT) != 0) {
+    PyErr_Clear();
+    return -1;
+  }
+  if (!is_float64_matrix(view)) {
+    PyBuffer_Release(view);
+    return -1;
+  }
+  return 0;
+}
 
+/**
+ * Python object to matrix. Anything exporting a C-contiguous float64 2-D buffer (a NumPy
+ * array, a memoryview, ...) is used in place without copying; other inputs, such as lists
+ * of lists or float32 arrays, are first converted into a float64 NumPy array. The returned
+ * matrix does not own its data: free it, then release view, once the C code is done with it.
+ */
+static Matrix* PyObjectToMatrix(PyObject *obj, Py_buffer *view){
+  PyObject *converted;
+  Matrix *X;
+  if (get_float64_buffer(obj, view) != 0) {
+    converted = PyArray_FROMANY(obj, NPY_DOUBLE, 2, 2, NPY_ARRAY_IN_ARRAY);
+    if (converted == NULL) {
+      return NULL;
+    }
+    if (get_float64_buffer(converted, view) != 0) { /* the view keeps its own reference */
+      Py_DECREF(converted);
+      PyErr_SetString(PyExc_TypeError, "expected a 2-D float64 matrix");
+      return NULL;
+    }
+    Py_DECREF(converted);
+  }
+  if (view->shape[0] < 1 || view->shape[1] < 1 || view->shape[0] > INT_MAX || view->shape[1] > INT_MAX) {
+    PyBuffer_Release(view);
+    PyErr_SetString(PyExc_ValueError, "matrix dimensions must be between 1 and INT_MAX");
+    return NULL;
+  }
+  X = matrix_from_buffer((int)view->shape[0], (int)view->shape[1], (double *)view->buf, NULL);
+  if (X == NULL) {
+    PyBuffer_Release(view);
+    PyErr_NoMemory();
+  }
+  return X;
+}
+
+/* Frees the matrix behind an array returned by PyObjectFromMatrix once NumPy drops it */
+static void matrix_capsule_destructor(PyObject *capsule){
+  free_matrix((Matrix *)PyCapsule_GetPointer(capsule, MATRIX_CAPSULE));
+}
+
+/**
+ * C matrix struct to a NumPy array over the same buffer. The array takes ownership of X
+ * (through a capsule set as its base object), also when the conversion fails. The wrappers
+ * check every argument before calling into C, so a NULL X can only mean that an allocation
+ * failed and is raised as MemoryError.
+ */
+static PyObject* PyObjectFromMatrix(Matrix* X){
+  npy_intp dims[2], strides[2];
+  PyObject *array, *capsule;
+  if (X == NULL) {
+    return PyErr_NoMemory();
+  }
+  dims[0] = X->rows;
+  dims[1] = X->cols;
+  strides[0] = (npy_intp)X->stride * (npy_intp)sizeof(double);
+  strides[1] = sizeof(double);
+  array = PyArray_New(&PyArray_Type, 2, dims, NPY_DOUBLE, strides, X->data, 0,
+                      NPY_ARRAY_CARRAY, NULL);
+  if (array == NULL) {
+    free_matrix(X);
+    return NULL;
+  }
+  capsule = PyCapsule_New(X, MATRIX_CAPSULE, matrix_capsule_destructor);
+  if (capsule == NULL) {
+    Py_DECREF(array);
+    free_matrix(X);
+    return NULL;
+  }
+  if (PyArray_SetBaseObject((PyArrayObject *)array, capsule) != 0) {
+    Py_DECREF(array); /* the capsule reference was stolen, X is freed with it */
+    return NULL;
+  }
+  return array;
+}
+
+/* The Profile of a wrapper call as a dict, same layout as the JSON of symnmf --profile */
+static PyObject* PyObjectFromProfile(const Profile *profile){
+  PyObject *dict, *phases, *products, *item;
+  const ProfilePhase *phase;
+  const ProfileCounter *counter;
+  int i, status = 0;
+  phases = PyList_New(profile->phase_count);
+  products = PyDict_New();
+  for (i = 0; phases != NULL && i < profile->phase_count; i++) {
+    phase = &profile->phases[i];
+    item = Py_BuildValue("{s:s,s:l,s:d,s:d}", "name", phase->name, "calls", phase->calls,
+                         "wall", phase->wall, "cpu", phase->cpu);
+    if (item == NULL) {
+      status = -1;
+      break;
+    }
+    PyList_SET_ITEM(phases, i, item); /* steals item */
+  }
+  for (i = 0; products != NULL && status == 0 && i < PRODUCT_KINDS; i++) {
+    counter = &profile->products[i];
+    item = Py_BuildValue("{s:l,s:d,s:d}", "calls", counter->calls, "flops", counter->flops,
+                         "bytes", counter->bytes);
+    status = (item == NULL) ? -1 : PyDict_SetItemString(products, profile_product_name(i), item);
+    Py_XDECREF(item);
+  }
+  if (phases == NULL || products == NULL || status != 0) {
+    Py_XDECREF(phases);
+    Py_XDECREF(products);
+    return NULL;
+  }
+  dict = Py_BuildValue("{s:d,s:d,s:N,s:l,s:d,s:z,s:N,s:d,s:d}", "wall", profile->total.wall,
+                       "cpu", profile->total.cpu, "phases", phases, "iterations", profile->iterations,
+                       "convergence", profile->convergence, "stopped", profile->stopped,
+                       "products", products, "peak_allocated_bytes", profile->peak_allocated,
+                       "unmatched_freed_bytes", profile->unmatched_freed);
+  return dict;
+}
+
+/* result, or (result, profile dict) when the call was profiled; takes the reference to result */
+static PyObject* with_profile(PyObject *result, int profiling, const Profile *profile){
+  PyObject *dict;
+  if (result == NULL || !profiling) {
+    return result;
+  }
+  dict = PyObjectFromProfile(profile);
+  if (dict == NULL) {
+    Py_DECREF(result);
+    return NULL;
+  }
+  return Py_BuildValue("(NN)", result, dict);
+}
+
+/* Resolves the solver name into options and checks the limits (0 keeps a default), 0 on success */
+static int resolve_solver_options(SolverOptions *options, const char *solver){
+  options->solver = parse_solver(solver);
+  if (options->solver < 0) {
+    PyErr_SetString(PyExc_ValueError, "solver must be \"mu\", \"amu\" or \"hals\"");
+    return -1;
+  }
+  /* written as !(x >= 0) so that NaN fails too */
+  if (!(options->tolerance >= 0) || options->max_iter < 0 ||
+      !(options->beta >= 0 && options->beta <= 1) || !(options->time_budget >= 0)) {
+    PyErr_SetString(PyExc_ValueError,
+                    "tol, max_iter and time_budget must be non-negative, beta between 0 and 1");
+    return -1;
+  }
+  return 0;
+}
+
+/* result, or (result, status) when asked for, status naming how the solver stopped; takes the
+ * reference to result */
+static PyObject* with_status(PyObject *result, int returning, const SolverReport *report){
+  if (result == NULL || !returning) {
+    return result;
+  }
+  return Py_BuildValue("(Ns)", result, solver_status_name(report->status));
+}
+
+/* Resolves the kernel name into graph and checks the numeric settings, 0 on success */
+static int resolve_graph_options(GraphOptions *graph, const char *kernel){
+  graph->kernel = parse_kernel(kernel);
+  if (graph->kernel < 0) {
+    PyErr_SetString(PyExc_ValueError, "kernel must be \"gaussian\", \"laplacian\" or \"cauchy\"");
+    return -1;
+  }
+  if (!(graph->sigma >= 0) || graph->local_scaling < 0) { /* NaN fails too */
+    PyErr_SetString(PyExc_ValueError, "sigma and local_scaling must be non-negative");
+    return -1;
+  }
+  return 0;
 }
 
 /* Wrapper - sym */
-static PyObject *sym_wrapper(PyObject *self, PyObject *args){
+static PyObject *sym_wrapper(PyObject *self, PyObject *args, PyObject *kwargs){
+  static char *keywords[] = {"X", "fast_exp", "kernel", "sigma", "local_scaling", "profile", NULL};
+  const char *kernel = "gaussian";
   Matrix *input, *c_result;
-  PyObject *cords, *result;
-  
+  PyObject *cords;
+  Py_buffer view;
+  GraphOptions graph;
+  Profile profile;
+  int profiling = 0;
+  (void)self;
+
   /* parse arguments */
-  if (!PyArg_ParseTuple(args, "O", &points_obj))
+  memset(&graph, 0, sizeof(graph));
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|psdip", keywords, &cords, &graph.fast_exp,
+                                   &kernel, &graph.sigma, &graph.local_scaling, &profiling) ||
+      resolve_graph_options(&graph, kernel) != 0)
   {
       return NULL;
   }
-  input = PyObjectToMatrix(cords);
+  input = PyObjectToMatrix(cords, &view);
   if (input == NULL)
   {
       return NULL;
   }
   /* calculate */
-  c_result = calc_sym(input);
-  free_matrix(input);
-  if (c_result == NULL)
-  {
-      return NULL;
+  Py_BEGIN_ALLOW_THREADS
+  if (profiling) {
+    profile_begin(&profile);
   }
-  result = PyObjectFromMatrix(c_result);
-  free_matrix(c_result);
-  return result;
+  c_result = calc_sym(input, &graph);
+  free_matrix(input);
+  profile_end();
+  Py_END_ALLOW_THREADS
+  PyBuffer_Release(&view);
+  return with_profile(PyObjectFromMatrix(c_result), profiling, &profile);
 }
 
 /* Wrapper - ddg */
-static PyObject *ddg_wrapper(PyObject *self, PyObject *args){
-  Matrix *input, *sym, *c_result;
-  PyObject *cords, *result;
-  
+static PyObject *ddg_wrapper(PyObject *self, PyObject *args, PyObject *kwargs){
+  static char *keywords[] = {"X", "fast_exp", "kernel", "sigma", "local_scaling", "profile", NULL};
+  const char *kernel = "gaussian";
+  Matrix *input, *degrees, *c_result;
+  SymMatrix *sym;
+  PyObject *cords;
+  Py_buffer view;
+  GraphOptions graph;
+  Profile profile;
+  int profiling = 0;
+  (void)self;
+
   /* parse arguments */
-  if (!PyArg_ParseTuple(args, "O", &cords))
+  memset(&graph, 0, sizeof(graph));
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|psdip", keywords, &cords, &graph.fast_exp,
+                                   &kernel, &graph.sigma, &graph.local_scaling, &profiling) ||
+      resolve_graph_options(&graph, kernel) != 0)
   {
       return NULL;
   }
-  input = PyObjectToMatrix(cords);
+  input = PyObjectToMatrix(cords, &view);
   if (input == NULL)
   {
       return NULL;
   }
   /* calculate */
-  sym = calc_sym(input);
-  c_result = calc_ddg(sym);
-  free_matrix(input);
-  free_matrix(sym);
-  if (c_result == NULL)
-  {
-      return NULL;
+  Py_BEGIN_ALLOW_THREADS
+  if (profiling) {
+    profile_begin(&profile);
   }
-  result = PyObjectFromMatrix(c_result);
-  free_matrix(c_result);
-  return result;
+  sym = calc_sym_packed(input, &graph);
+  degrees = calc_ddg_packed(sym);
+  free_matrix(input);
+  free_sym_matrix(sym);
+  c_result = (degrees != NULL) ? diagonal_to_dense(degrees) : NULL;
+  free_matrix(degrees);
+  profile_end();
+  Py_END_ALLOW_THREADS
+  PyBuffer_Release(&view);
+  return with_profile(PyObjectFromMatrix(c_result), profiling, &profile);
 }
 
 /* Wrapper - norm */
-static PyObject *norm_wrapper(PyObject *self, PyObject *args){
-  Matrix *input, *sym, *ddg, *c_result;
-  PyObject *cords, *result;
-  
+static PyObject *norm_wrapper(PyObject *self, PyObject *args, PyObject *kwargs){
+  static char *keywords[] = {"X", "fast_exp", "kernel", "sigma", "local_scaling", "profile", NULL};
+  const char *kernel = "gaussian";
+  Matrix *input, *degrees, *c_result = NULL;
+  SymMatrix *sym;
+  PyObject *cords;
+  Py_buffer view;
+  GraphOptions graph;
+  Profile profile;
+  int profiling = 0;
+  (void)self;
+
   /* parse arguments */
-  if (!PyArg_ParseTuple(args, "O", &cords))
+  memset(&graph, 0, sizeof(graph));
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|psdip", keywords, &cords, &graph.fast_exp,
+                                   &kernel, &graph.sigma, &graph.local_scaling, &profiling) ||
+      resolve_graph_options(&graph, kernel) != 0)
   {
       return NULL;
   }
-  input = PyObjectToMatrix(cords);
+  input = PyObjectToMatrix(cords, &view);
   if (input == NULL)
   {
       return NULL;
   }
-  /* calculate */
-  sym = calc_sym(input);
-  ddg = calc_ddg(sym);
-  c_result = calc_norm(sym, ddg);
+  /* calculate: W overwrites the packed A and is expanded only for the result */
+  Py_BEGIN_ALLOW_THREADS
+  if (profiling) {
+    profile_begin(&profile);
+  }
+  sym = calc_sym_packed(input, &graph);
   free_matrix(input);
-  free_matrix(sym);
-  free_matrix(ddg);
-  if (c_result == NULL)
+  degrees = calc_ddg_packed(sym);
+  if (degrees != NULL && calc_norm_packed_in_place(sym, degrees) == 0)
   {
-      return NULL;
+      c_result = sym_to_dense(sym);
   }
-  result = PyObjectFromMatrix(c_result);
-  free_matrix(c_result);
-  return result;
+  free_matrix(degrees);
+  free_sym_matrix(sym);
+  profile_end();
+  Py_END_ALLOW_THREADS
+  PyBuffer_Release(&view);
+  return with_profile(PyObjectFromMatrix(c_result), profiling, &profile);
 }
 
 /* Wrapper - symnmf */
-static PyObject *norm_wrapper(PyObject *self, PyObject *args){
+static PyObject *symnmf_wrapper(PyObject *self, PyObject *args, PyObject *kwargs){
+  static char *keywords[] = {"H", "W", "solver", "tol", "max_iter", "beta", "time_budget",
+                             "return_status", "profile", NULL};
+  const char *solver_name = "mu";
   Matrix *H_input, *W_input, *c_result;
-  PyObject *H_cords, *W_cords *result;
-  
+  SymMatrix *W_packed;
+  PyObject *H_cords, *W_cords;
+  Py_buffer H_view, W_view;
+  SolverOptions solver;
+  SolverReport report;
+  Profile profile;
+  int returning_status = 0, profiling = 0;
+  (void)self;
+
   /* parse arguments */
-  if (!PyArg_ParseTuple(args, "OO", &H_cords, &W_cords))
+  memset(&solver, 0, sizeof(solver));
+  solver.report = &report;
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OO|sdiddpp", keywords, &H_cords, &W_cords,
+                                   &solver_name, &solver.tolerance, &solver.max_iter, &solver.beta,
+                                   &solver.time_budget, &returning_status, &profiling) ||
+      resolve_solver_options(&solver, solver_name) != 0)
   {
       return NULL;
   }
-  H_input = PyObjectToMatrix(H_cords);
+  H_input = PyObjectToMatrix(H_cords, &H_view);
   if (H_input == NULL)
   {
       return NULL;
   }
-  W_input = PyObjectToMatrix(W_cords);
+  W_input = PyObjectToMatrix(W_cords, &W_view);
   if (W_input == NULL)
   {
-      free_matrix(H_input)
+      free_matrix(H_input);
+      PyBuffer_Release(&H_view);
+      return NULL;
+  }
+  if (W_input->rows != W_input->cols || W_input->rows != H_input->rows)
+  {
+      free_matrix2(H_input, W_input);
+      PyBuffer_Release(&H_view);
+      PyBuffer_Release(&W_view);
+      PyErr_SetString(PyExc_ValueError, "W must be n x n and H must have n rows");
       return NULL;
   }
 
   /* calculate */
-  c_result = calc_symnmf(H_input, W_input);
-  free_matrix(H_input);
+  Py_BEGIN_ALLOW_THREADS
+  if (profiling) {
+    profile_begin(&profile);
+  }
+  W_packed = dense_to_sym(W_input);
   free_matrix(W_input);
-  if (c_result == NULL)
+  c_result = (W_packed != NULL) ? symnmf(H_input, W_packed, &solver) : NULL;
+  free_matrix(H_input);
+  free_sym_matrix(W_packed);
+  profile_end();
+  Py_END_ALLOW_THREADS
+  PyBuffer_Release(&W_view);
+  PyBuffer_Release(&H_view);
+  return with_profile(with_status(PyObjectFromMatrix(c_result), returning_status, &report),
+                      profiling, &profile);
+}
+
+/* Wrapper - pipeline: points and k to the final H, W never leaves C */
+static PyObject *pipeline_wrapper(PyObject *self, PyObject *args, PyObject *kwargs){
+  static char *keywords[] = {"X", "k", "seed", "neighbors", "threshold", "fast_exp", "kernel", "sigma",
+                             "local_scaling", "solver", "tol", "max_iter", "beta", "time_budget",
+                             "return_status", "profile", NULL};
+  const char *kernel = "gaussian", *solver_name = "mu";
+  Matrix *input, *c_result;
+  PyObject *cords;
+  Py_buffer view;
+  GraphOptions graph;
+  SolverOptions solver;
+  SolverReport report;
+  Profile profile;
+  int k, returning_status = 0, profiling = 0;
+  unsigned long seed;
+  (void)self;
+
+  /* parse arguments */
+  memset(&graph, 0, sizeof(graph));
+  memset(&solver, 0, sizeof(solver));
+  solver.report = &report;
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "Oik|idpsdisdiddpp", keywords, &cords, &k, &seed,
+                                   &graph.neighbors, &graph.threshold, &graph.fast_exp, &kernel,
+                                   &graph.sigma, &graph.local_scaling, &solver_name, &solver.tolerance,
+                                   &solver.max_iter, &solver.beta, &solver.time_budget,
+                                   &returning_status, &profiling) ||
+      resolve_graph_options(&graph, kernel) != 0 || resolve_solver_options(&solver, solver_name) != 0)
+  {
+      return NULL;
+  }
+  if (seed > 0xffffffffUL || graph.neighbors < 0 || !(graph.threshold >= 0))
+  {
+      PyErr_SetString(PyExc_ValueError, "seed must be below 2**32, neighbors and threshold non-negative");
+      return NULL;
+  }
+  input = PyObjectToMatrix(cords, &view);
+  if (input == NULL)
   {
       return NULL;
   }
-  result = PyObjectFromMatrix(c_result);
-  free_matrix(c_result);
-  return result;
+  if (k < 1 || k >= input->rows)
+  {
+      free_matrix(input);
+      PyBuffer_Release(&view);
+      PyErr_SetString(PyExc_ValueError, "k must be between 1 and the number of points - 1");
+      return NULL;
+  }
+  /* calculate */
+  Py_BEGIN_ALLOW_THREADS
+  if (profiling) {
+    profile_begin(&profile);
+  }
+  c_result = symnmf_pipeline(input, k, seed, &graph, &solver);
+  free_matrix(input);
+  profile_end();
+  Py_END_ALLOW_THREADS
+  PyBuffer_Release(&view);
+  return with_profile(with_status(PyObjectFromMatrix(c_result), returning_status, &report),
+                      profiling, &profile);
 }
 
 /* Module's methods definitions */
 static PyMethodDef symnmf_Methods[] = {
     {
         "sym",       /* name exposed to Python */
-        sym_wrapper, /* C wrapper function */
-        METH_VARARGS,
-        "Computes the similarity matrix A from X" /* documentation */
+        (PyCFunction)(void (*)(void))sym_wrapper, /* C wrapper function */
+        METH_VARARGS | METH_KEYWORDS,
+        "Computes the similarity matrix A from X" "; keywords as in pipeline" /* documentation */
     },
     {
         "ddg",       /* name exposed to Python */
-        ddg_wrapper, /* C wrapper function */
-        METH_VARARGS,
-        "Computes the Diagonal Degree Matrix" /* documentation */
+        (PyCFunction)(void (*)(void))ddg_wrapper, /* C wrapper function */
+        METH_VARARGS | METH_KEYWORDS,
+        "Computes the Diagonal Degree Matrix" "; keywords as in pipeline" /* documentation */
     },
     {
         "norm",       /* name exposed to Python */
-        norm_wrapper, /* C wrapper function */
-        METH_VARARGS,
-        "Computes the normalized similarity W" /* documentation */
+        (PyCFunction)(void (*)(void))norm_wrapper, /* C wrapper function */
+        METH_VARARGS | METH_KEYWORDS,
+        "Computes the normalized similarity W" "; keywords as in pipeline" /* documentation */
     },
     {
         "symnmf",       /* name exposed to Python */
-        symnmf_wrapper, /* C wrapper function */
-        METH_VARARGS,
-        "Finds the decomposition matrix H" /* documentation */
+        (PyCFunction)(void (*)(void))symnmf_wrapper, /* C wrapper function */
+        METH_VARARGS | METH_KEYWORDS,
+        "Finds the decomposition matrix H: symnmf(H, W, solver=\"mu\", tol=1e-4, max_iter=300,\n"
+        "beta=0.5, time_budget=0.0, return_status=False, profile=False); solver settings as in\n"
+        "pipeline" /* documentation */
+    },
+    {
+        "pipeline",       /* name exposed to Python */
+        (PyCFunction)(void (*)(void))pipeline_wrapper, /* C wrapper function */
+        METH_VARARGS | METH_KEYWORDS,
+        "Computes W from X, initializes H from a seed and finds H:\n"
+        "pipeline(X, k, seed, neighbors=0, threshold=0.0, fast_exp=False, kernel=\"gaussian\",\n"
+        "sigma=1.0, local_scaling=0, solver=\"mu\", tol=1e-4, max_iter=300, beta=0.5, time_budget=0.0,\n"
+        "return_status=False); a positive neighbors or threshold builds W as a sparse\n"
+        "k-nearest-neighbor or thresholded graph, fast_exp evaluates the dense affinities with\n"
+        "the vectorized exp (a few ulps from libm); kernel is \"gaussian\", \"laplacian\" or\n"
+        "\"cauchy\" with bandwidth sigma, or with sigma_i * sigma_j from the distances to the\n"
+        "local_scaling-th nearest neighbors when that is positive; solver is \"mu\" for the\n"
+        "multiplicative updates, \"amu\" for their accelerated variant or \"hals\" for\n"
+        "coordinate descent. It stops once ||H_next - H||_F^2 < tol, after max_iter iterations or\n"
+        "before an iteration that would end past time_budget seconds from the call (0: no\n"
+        "budget), returning the last H, or the one with the lowest ||W - HH^T||_F^2 so far when\n"
+        "the budget ran out; beta damps the multiplicative rule. return_status=True returns (H, status),\n"
+        "status being \"converged\", \"max_iter\" or \"time_budget\". With profile=True every\n"
+        "function returns (result, profile), profile being a dict of the phase timings and\n"
+        "counters that symnmf --profile prints" /* documentation */
     },
     {NULL, NULL, 0, NULL}};
 
 /* Module definition */
 static struct PyModuleDef symnmf_Module = {
     PyModuleDef_HEAD_INIT,
-    "symnmfC",                                         /* name of module exposed to Python */
+    "symnmfmodule",                                    /* name of module exposed to Python */
     "A C extension library for the symNMF algorithm.", /* module documentation*/
     -1,
-    symnmf_Functions};
+    symnmf_Methods,
+    NULL,
+    NULL,
+    NULL,
+    NULL};
 
-PyMODINIT_FUNC PyInit_symnmf(void)
+PyMODINIT_FUNC PyInit_symnmfmodule(void)
 {
+    import_array();
     return PyModule_Create(&symnmf_Module);
-}
\ No newline at end of file
+}
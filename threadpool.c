@@ -0,0 +1,191 @@
+/**
+ * Worker pool behind parallel_for. Workers sleep on a condition variable until a new job
+ * is published, then claim chunks from a shared counter until the range is exhausted.
+ */
+#define _POSIX_C_SOURCE 200112L
+#include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "threadpool.h"
+
+typedef struct {
+    parallel_task task;
+    void *context;
+    int count;
+    int grain;
+    int next; /* first index not yet claimed */
+} Job;
+
+static pthread_mutex_t init_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t job_ready = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t job_done = PTHREAD_COND_INITIALIZER;
+static pthread_t *workers = NULL;
+static int pool_threads = 1;
+static int initialized = 0;
+static int busy = 0;
+static int stopping = 0;
+static int generation = 0; /* bumped whenever a job is published */
+static int active = 0; /* workers still running the current job */
+static Job current;
+
+static void stop_pool(void);
+
+/* Claims and runs chunks of the current job until none are left; called with pool_lock held */
+static void run_chunks(int worker){
+  int begin, end;
+  while (current.next < current.count) {
+    begin = current.next;
+    end = (current.count - begin < current.grain) ? current.count : begin + current.grain;
+    current.next = end;
+    pthread_mutex_unlock(&pool_lock);
+    current.task(current.context, begin, end, worker);
+    pthread_mutex_lock(&pool_lock);
+  }
+}
+
+static void* worker_main(void *arg){
+  int worker = (int)(size_t)arg, seen = 0;
+  pthread_mutex_lock(&pool_lock);
+  for (;;) {
+    while (!stopping && generation == seen) {
+      pthread_cond_wait(&job_ready, &pool_lock);
+    }
+    if (stopping) {
+      break;
+    }
+    seen = generation;
+    run_chunks(worker);
+    active--;
+    if (active == 0) {
+      pthread_cond_signal(&job_done);
+    }
+  }
+  pthread_mutex_unlock(&pool_lock);
+  return NULL;
+}
+
+static int default_threads(void){
+  const char *env = getenv(THREADS_ENV);
+  long cpus;
+  if (env != NULL && atoi(env) > 0) {
+    return atoi(env);
+  }
+  cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  return (cpus > 0) ? (int)cpus : 1;
+}
+
+/* Joins all workers; called without pool_lock held */
+static void stop_workers(void){
+  int i;
+  pthread_mutex_lock(&pool_lock);
+  stopping = 1;
+  pthread_cond_broadcast(&job_ready);
+  pthread_mutex_unlock(&pool_lock);
+  for (i = 1; i < pool_threads; i++) {
+    pthread_join(workers[i], NULL);
+  }
+  free(workers);
+  workers = NULL;
+  pool_threads = 1;
+  stopping = 0;
+}
+
+/* (Re)starts the pool; called with init_lock held */
+static int start_pool(int num_threads){
+  int i;
+  stop_pool();
+  if (num_threads < 1) {
+    num_threads = default_threads();
+  }
+  initialized = 1;
+  if (num_threads == 1) {
+    return 0;
+  }
+  workers = (pthread_t *)malloc((size_t)num_threads * sizeof(pthread_t));
+  if (workers == NULL) {
+    return -1;
+  }
+  for (i = 1; i < num_threads; i++) {
+    if (pthread_create(&workers[i], NULL, worker_main, (void *)(size_t)i) != 0) {
+      pool_threads = i; /* join the ones that did start */
+      stop_workers();
+      return -1;
+    }
+  }
+  pool_threads = num_threads;
+  return 0;
+}
+
+/* Joins the workers, if any; called with init_lock held */
+static void stop_pool(void){
+  if (workers != NULL) {
+    stop_workers();
+  }
+  initialized = 0;
+}
+
+int threadpool_init(int num_threads){
+  int status;
+  pthread_mutex_lock(&init_lock);
+  status = start_pool(num_threads);
+  pthread_mutex_unlock(&init_lock);
+  return status;
+}
+
+void threadpool_shutdown(void){
+  pthread_mutex_lock(&init_lock);
+  stop_pool();
+  pthread_mutex_unlock(&init_lock);
+}
+
+/* Starts the default-sized pool on first use */
+static void ensure_initialized(void){
+  pthread_mutex_lock(&init_lock);
+  if (!initialized) {
+    start_pool(0);
+  }
+  pthread_mutex_unlock(&init_lock);
+}
+
+int threadpool_size(void){
+  ensure_initialized();
+  return pool_threads;
+}
+
+void parallel_for(int count, int grain, parallel_task task, void *context){
+  int inline_run;
+  if (count <= 0) {
+    return;
+  }
+  if (grain < 1) {
+    grain = 1;
+  }
+  ensure_initialized();
+  pthread_mutex_lock(&pool_lock);
+  inline_run = (pool_threads == 1 || count <= grain || busy);
+  if (!inline_run) {
+    busy = 1;
+  }
+  pthread_mutex_unlock(&pool_lock);
+  if (inline_run) {
+    task(context, 0, count, 0);
+    return;
+  }
+
+  pthread_mutex_lock(&pool_lock);
+  current.task = task;
+  current.context = context;
+  current.count = count;
+  current.grain = grain;
+  current.next = 0;
+  active = pool_threads - 1;
+  generation++;
+  pthread_cond_broadcast(&job_ready);
+  run_chunks(0);
+  while (active > 0) {
+    pthread_cond_wait(&job_done, &pool_lock);
+  }
+  busy = 0;
+  pthread_mutex_unlock(&pool_lock);
+}
@@ -0,0 +1,39 @@
+/**
+ * This header file declares a small fixed-size worker pool and a parallel_for built on it.
+ * Work is handed out in chunks of consecutive indices; callers must make every index's
+ * result independent of which worker ran it, which keeps outputs identical for any
+ * number of threads.
+ */
+
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+/* Environment variable consulted when no explicit thread count is given */
+#define THREADS_ENV "SYMNMF_THREADS"
+
+/**
+ * Task run by parallel_for over the index range [begin, end). `worker` is in
+ * [0, threadpool_size()) and no two chunks of the same parallel_for call run
+ * concurrently with the same value, so it can pick per-worker scratch buffers.
+ */
+typedef void (*parallel_task)(void *context, int begin, int end, int worker);
+
+/**
+ * Starts the pool with num_threads threads (the caller counts as one). A value below 1
+ * means "use SYMNMF_THREADS, or the number of online CPUs". Restarts an existing pool.
+ * Returns 0 on success; on failure the pool falls back to running everything inline.
+ * Init and shutdown are serialized with each other, but must not overlap parallel_for calls.
+ */
+int threadpool_init(int num_threads);
+void threadpool_shutdown(void);
+int threadpool_size(void);
+
+/**
+ * Runs task over [0, count) in chunks of at most `grain` indices and returns when all chunks
+ * are done. Runs inline when the pool has one thread, when there is only one chunk, or when
+ * the pool is already busy (nested or concurrent calls), so it is safe to call from
+ * several threads at once.
+ */
+void parallel_for(int count, int grain, parallel_task task, void *context);
+
+#endif
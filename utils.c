@@ -1,126 +1,703 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <math.h>
 #include "utils.h"
 #include "mat_utils.h"
+#include "mapped.h"
+#include "profile.h"
 
-int getline(char **lineptr, size_t *n, FILE *stream)
-{
-    size_t pos = 0, new_size;
-    int c;
-    char *new_lineptr;
-    if (*lineptr == NULL || *n == 0)
-    {
-        /* Allocate initial buffer */
-        *n = 128;
-        *lineptr = malloc(*n);
-        if (*lineptr == NULL)
-        {
-            return -1;
-        }
+#define READ_CHUNK (1 << 20) /* bytes requested from the file per fread */
+#define MAX_TOKEN 512 /* longest number handed to strtod on the slow path */
+#define EXACT_DIGITS 15 /* decimal digits that always fit exactly in a double */
+#define EXACT_POWER 22 /* largest power of 10 that is exact in a double */
+#define TEXT_CHUNK (1 << 20) /* bytes of formatted text handed to fwrite at once */
+#define FIXED4_FAST_LIMIT 1e11 /* below this, |x| * 10^4 is an exact integer range for doubles */
+#define MAX_FIXED4_LENGTH 320 /* longest "%.4f" rendering of a double (-DBL_MAX) */
+
+static const double powers_of_ten[EXACT_POWER + 1] = {
+  1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+  1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+/* Parser state: the matrix grows row by row in a single aligned buffer */
+typedef struct {
+    const char *filename;
+    long line;
+    int rows;
+    int cols; /* -1 until the first row is read */
+    size_t count; /* values stored so far */
+    size_t capacity;
+    double *data;
+    void *block;
+} ParseState;
+
+static int is_blank(char c){
+  return c == ' ' || c == '\t' || c == '\r';
+}
+
+static int is_digit(char c){
+  return c >= '0' && c <= '9';
+}
+
+static void parse_error(ParseState *state, const char *message, int found){
+  if (found >= 0) {
+    fprintf(stderr, "%s:%ld: %s (expected %d values, found %d)\n",
+            state->filename, state->line, message, state->cols, found);
+  } else {
+    fprintf(stderr, "%s:%ld: %s\n", state->filename, state->line, message);
+  }
+}
+
+/**
+ * Reads a decimal number from [*cursor, end) and advances *cursor past it.
+ * Numbers with at most EXACT_DIGITS significant digits and a decimal exponent of at most
+ * EXACT_POWER are one exact integer scaled by one exact power of ten, which rounds exactly
+ * like strtod; anything else (long mantissas, large exponents, inf/nan) goes through strtod.
+ * Returns 0 on success and -1 if no number starts at *cursor.
+ */
+static int scan_double(const char **cursor, const char *end, double *value){
+  const char *p = *cursor, *start = *cursor;
+  double mantissa = 0.0;
+  int negative = 0, digits = 0, seen_digit = 0, exact = 1, exponent = 0, exp_value = 0, exp_negative = 0;
+  char token[MAX_TOKEN + 1], *token_end;
+  size_t length;
+
+  if (p < end && (*p == '+' || *p == '-')) {
+    negative = (*p == '-');
+    p++;
+  }
+  for (; p < end && is_digit(*p); p++) {
+    seen_digit = 1;
+    if (digits == 0 && *p == '0') {
+      continue; /* leading zeros are not significant */
     }
-    while ((c = fgetc(stream)) != EOF && c != '\n')
-    {
-        if (pos + 1 >= *n) /* We ensure that we have at least 1 more byte to be able to add the terminate character - */
-        {
-            /* Resize buffer if needed */
-            new_size = *n * 2;
-            new_lineptr = realloc(*lineptr, new_size);
-            if (new_lineptr == NULL)
-            {
-                free(*lineptr);
-                return -1;
-            }
-            *lineptr = new_lineptr;
-            *n = new_size;
+    if (digits < EXACT_DIGITS) {
+      mantissa = mantissa * 10 + (*p - '0');
+    } else {
+      exact = 0;
+    }
+    digits++;
+  }
+  if (p < end && *p == '.') {
+    for (p++; p < end && is_digit(*p); p++) {
+      seen_digit = 1;
+      if (digits == 0 && *p == '0') {
+        exponent--;
+        continue;
+      }
+      if (digits < EXACT_DIGITS) {
+        mantissa = mantissa * 10 + (*p - '0');
+        exponent--;
+      } else {
+        exact = 0;
+      }
+      digits++;
+    }
+  }
+  if (seen_digit && p < end && (*p == 'e' || *p == 'E')) {
+    const char *exp_start = p++;
+    if (p < end && (*p == '+' || *p == '-')) {
+      exp_negative = (*p == '-');
+      p++;
+    }
+    if (p < end && is_digit(*p)) {
+      for (; p < end && is_digit(*p); p++) {
+        if (exp_value < 10000) {
+          exp_value = exp_value * 10 + (*p - '0');
         }
-        (*lineptr)[pos] = c;
-        pos += 1;
+      }
+      exponent += exp_negative ? -exp_value : exp_value;
+    } else {
+      p = exp_start; /* "1e" is the number 1 followed by garbage */
+    }
+  }
+
+  if (seen_digit && exact && exponent >= -EXACT_POWER && exponent <= EXACT_POWER) {
+    mantissa = (exponent < 0) ? mantissa / powers_of_ten[-exponent] : mantissa * powers_of_ten[exponent];
+    *value = negative ? -mantissa : mantissa;
+    *cursor = p;
+    return 0;
+  }
+
+  /* Slow path: let strtod decide, on a NUL terminated copy of the field */
+  for (p = start; p < end && *p != ',' && *p != '\n' && !is_blank(*p); p++) {
+  }
+  length = (size_t)(p - start);
+  if (length == 0 || length > MAX_TOKEN) {
+    return -1;
+  }
+  memcpy(token, start, length);
+  token[length] = '\0';
+  *value = strtod(token, &token_end);
+  if (token_end == token) {
+    return -1;
+  }
+  *cursor = start + (token_end - token);
+  return 0;
+}
+
+/* Makes room for at least one more value, doubling the buffer */
+static int reserve_value(ParseState *state){
+  size_t capacity;
+  void *block;
+  double *data;
+  if (state->count < state->capacity) {
+    return 0;
+  }
+  capacity = (state->capacity > 0) ? state->capacity * 2 : 1024;
+  data = (double *)allocate_aligned(capacity * sizeof(double), &block);
+  if (data == NULL) {
+    return -1;
+  }
+  if (state->count > 0) {
+    memcpy(data, state->data, state->count * sizeof(double));
+  }
+  free(state->block);
+  state->data = data;
+  state->block = block;
+  state->capacity = capacity;
+  return 0;
+}
+
+/* Parses one line (without its '\n') as comma separated values; blank lines are skipped */
+static int parse_line(ParseState *state, const char *p, const char *end){
+  int found = 0;
+  double value;
+  state->line++;
+  while (p < end && is_blank(*p)) {
+    p++;
+  }
+  if (p == end) {
+    return 0;
+  }
+  for (;;) {
+    while (p < end && is_blank(*p)) {
+      p++;
+    }
+    if (scan_double(&p, end, &value) != 0) {
+      parse_error(state, "malformed number", -1);
+      return -1;
+    }
+    if (state->cols >= 0 && found == state->cols) {
+      parse_error(state, "too many values", found + 1);
+      return -1;
+    }
+    if (reserve_value(state) != 0) {
+      return -1;
+    }
+    state->data[state->count++] = value;
+    found++;
+    while (p < end && is_blank(*p)) {
+      p++;
+    }
+    if (p == end) {
+      break;
     }
-    if (c == EOF && pos == 0)
-    {
-        return -1; /* End of file reached and no characters read */
+    if (*p != ',') {
+      parse_error(state, "unexpected character", -1);
+      return -1;
     }
-    (*lineptr)[pos] = '\0';
-    return pos;
+    p++;
+  }
+  if (state->cols < 0) {
+    state->cols = found;
+  } else if (found != state->cols) {
+    parse_error(state, "ragged row", found);
+    return -1;
+  }
+  state->rows++;
+  return 0;
+}
+
+/* Parses every complete line in [begin, end) and returns the start of the unfinished tail */
+static const char* parse_lines(ParseState *state, const char *begin, const char *end, int *status){
+  const char *newline;
+  *status = 0;
+  while (begin < end) {
+    newline = (const char *)memchr(begin, '\n', (size_t)(end - begin));
+    if (newline == NULL) {
+      break;
+    }
+    if (parse_line(state, begin, newline) != 0) {
+      *status = -1;
+      return begin;
+    }
+    begin = newline + 1;
+  }
+  return begin;
+}
+
+/* 1 if doubles are stored little-endian on this machine */
+static int host_is_little_endian(void){
+  double probe = 1.0;
+  return ((unsigned char *)&probe)[sizeof(double) - 1] != 0;
+}
+
+static void reverse_bytes(unsigned char *bytes, size_t size){
+  size_t i;
+  unsigned char tmp;
+  for (i = 0; i < size / 2; i++) {
+    tmp = bytes[i];
+    bytes[i] = bytes[size - 1 - i];
+    bytes[size - 1 - i] = tmp;
+  }
+}
+
+/* Stores a dimension as an unsigned 64 bit little-endian integer; dimensions are ints,
+ * so the upper four bytes are always zero */
+static void put_dimension(unsigned char *bytes, int value){
+  int i;
+  for (i = 0; i < 4; i++) {
+    bytes[i] = (unsigned char)(value & 0xFF);
+    value >>= 8;
+  }
+  memset(bytes + 4, 0, 4);
 }
 
-int *get_file_shape(FILE *file){
-  int rows = 0, cols = 0;
-  char *line = NULL, *token;
-  size_t len = 0;
-  long read;
-  int first_row = 1;
-  int *shape = malloc(2 * sizeof(int));
-  if (shape == NULL){
+/* Reads an unsigned 64 bit little-endian dimension, -1 if it does not fit an int */
+static int get_dimension(const unsigned char *bytes){
+  unsigned long value = 0;
+  int i;
+  for (i = 7; i >= 4; i--) {
+    if (bytes[i] != 0) {
+      return -1;
+    }
+  }
+  for (i = 3; i >= 0; i--) {
+    value = (value << 8) | bytes[i];
+  }
+  return (value > 0x7FFFFFFFUL) ? -1 : (int)value;
+}
+
+/**
+ * Maps the data section of a float64 binary matrix file copy-on-write, so the matrix is paged
+ * in from the file on demand instead of being read into the heap. NULL if the file is shorter
+ * than its header claims or cannot be mapped.
+ */
+static Matrix* map_matrix_file(const char *filename, int rows, int cols){
+  size_t size, count = (size_t)rows * (size_t)cols;
+  unsigned char *base;
+  Matrix *matrix;
+  if (count > ((size_t)-1 - BINARY_HEADER_SIZE) / sizeof(double)) {
     return NULL;
   }
-  /* Count rows and columns */
-  while ((read = getline(&line, &len, file)) != -1) {
-      rows++;
-      if (first_row){
-        token = strtok(line, ",");
-        while (token != NULL) {
-          cols++;
-          token = strtok(NULL, ",");
-        }
-        first_row = 0;
+  base = (unsigned char *)map_existing_file(filename, &size);
+  if (base == NULL) {
+    return NULL;
+  }
+  if (size < BINARY_HEADER_SIZE + count * sizeof(double)) {
+    unmap_buffer(base, size);
+    return NULL;
+  }
+  matrix = matrix_from_buffer(rows, cols, (double *)(base + BINARY_HEADER_SIZE), base);
+  if (matrix == NULL) {
+    unmap_buffer(base, size);
+    return NULL;
+  }
+  matrix->mapped = size;
+  return matrix;
+}
+
+/* Reads a binary matrix file (see utils.h) into a new matrix */
+static Matrix* binary_file_to_matrix(FILE *file, const char *filename){
+  unsigned char header[BINARY_HEADER_SIZE];
+  int rows, cols, element_size, swap = !host_is_little_endian();
+  size_t i, count;
+  float *singles;
+  Matrix *matrix;
+  if (fread(header, 1, BINARY_HEADER_SIZE, file) != BINARY_HEADER_SIZE ||
+      header[4] != BINARY_VERSION || (header[5] != BINARY_FLOAT64 && header[5] != BINARY_FLOAT32)) {
+    fprintf(stderr, "%s: unsupported binary matrix header\n", filename);
+    return NULL;
+  }
+  rows = get_dimension(header + 8);
+  cols = get_dimension(header + 16);
+  element_size = (header[5] == BINARY_FLOAT64) ? 8 : 4;
+  if (rows <= 0 || cols <= 0) {
+    fprintf(stderr, "%s: bad binary matrix dimensions\n", filename);
+    return NULL;
+  }
+  count = (size_t)rows * (size_t)cols;
+  if (element_size == 8 && !swap) {
+    matrix = map_matrix_file(filename, rows, cols);
+    if (matrix != NULL) {
+      return matrix;
+    }
+  }
+  matrix = allocate_matrix(rows, cols);
+  if (matrix == NULL) {
+    return NULL;
+  }
+  if (fread(matrix->data, (size_t)element_size, count, file) != count) {
+    fprintf(stderr, "%s: truncated binary matrix\n", filename);
+    free_matrix(matrix);
+    return NULL;
+  }
+  if (element_size == 4) {
+    /* widen in place, back to front so unread floats are never overwritten */
+    singles = (float *)matrix->data;
+    for (i = count; i-- > 0;) {
+      if (swap) {
+        reverse_bytes((unsigned char *)&singles[i], 4);
       }
+      matrix->data[i] = (double)singles[i];
+    }
+  } else if (swap) {
+    for (i = 0; i < count; i++) {
+      reverse_bytes((unsigned char *)&matrix->data[i], 8);
+    }
   }
-  free(line);
-  shape[0] = rows;
-  shape[1] = cols;
-  return shape;
+  return matrix;
 }
 
+/**
+ * Reads a comma separated file in one pass: the file is read in READ_CHUNK pieces, complete
+ * lines are parsed straight out of the read buffer, and only an unfinished last line is carried
+ * over to the next read. Malformed numbers and rows whose length differs from the first row
+ * are reported on stderr with their line number, and NULL is returned.
+ */
 Matrix* file_to_matrix(char *filename) {
-    FILE *file = fopen(filename, "r");
-    int rows, cols, i, j;
-    char *line = NULL, *token;
-    size_t len = 0;
-    long read;
-    int *shape;
+    FILE *file = fopen(filename, "rb");
+    ParseState state;
+    char *buffer, *grown;
+    const char *rest;
+    size_t size = READ_CHUNK, length = 0, got;
+    int status = 0;
+    char magic[4];
     Matrix *matrix;
     if (file == NULL){
       return NULL;
     }
-
-    shape = get_file_shape(file);
-    if (shape == NULL){
-      return NULL;
+    got = fread(magic, 1, 4, file);
+    if (got == 4 && memcmp(magic, BINARY_MAGIC, 4) == 0) {
+      rewind(file);
+      matrix = binary_file_to_matrix(file, filename);
+      fclose(file);
+      return matrix;
     }
-    rows = shape[0];
-    cols = shape[1];
-    free(shape);
-
-    /* Reset file pointer */
     rewind(file);
+    buffer = (char *)malloc(size);
+    if (buffer == NULL){
+      fclose(file);
+      return NULL;
+    }
+    memset(&state, 0, sizeof(state));
+    state.filename = filename;
+    state.cols = -1;
 
-    matrix = allocate_matrix(rows, cols);
-    if (matrix == NULL) {
-        fclose(file);
-        return NULL; /* Error: memory allocation failed */
-    }
-    /* Read data into matrix */
-    i = 0;
-    while ((read = getline(&line, &len, file)) != -1) {
-        token = strtok(line, ",");
-        j = 0;
-        while (token != NULL && j < cols) {
-            matrix->cords[i][j] = atof(token);
-            token = strtok(NULL, ",");
-            j++;
+    for (;;) {
+      if (length == size) { /* a single line longer than the buffer */
+        grown = (char *)realloc(buffer, size * 2);
+        if (grown == NULL) {
+          status = -1;
+          break;
         }
-        i++;
+        buffer = grown;
+        size *= 2;
+      }
+      got = fread(buffer + length, 1, size - length, file);
+      length += got;
+      if (got == 0) {
+        if (ferror(file)) {
+          status = -1;
+        } else if (length > 0) {
+          status = parse_line(&state, buffer, buffer + length); /* last line without '\n' */
+        }
+        break;
+      }
+      rest = parse_lines(&state, buffer, buffer + length, &status);
+      if (status != 0) {
+        break;
+      }
+      length -= (size_t)(rest - buffer);
+      memmove(buffer, rest, length);
     }
-    free(line);
+    free(buffer);
     fclose(file);
+
+    if (status != 0 || state.rows == 0) {
+      free(state.block);
+      return NULL;
+    }
+    matrix = matrix_from_buffer(state.rows, state.cols, state.data, state.block);
+    if (matrix == NULL) {
+      free(state.block);
+      return NULL;
+    }
+    profile_allocation((double)state.count * sizeof(double)); /* freed by free_matrix */
     return matrix;
 }
 
+int parse_format(const char *name){
+  if (strcmp(name, "text") == 0) {
+    return FORMAT_TEXT;
+  }
+  if (strcmp(name, "binary") == 0) {
+    return FORMAT_BINARY;
+  }
+  if (strcmp(name, "binary32") == 0) {
+    return FORMAT_BINARY32;
+  }
+  return -1;
+}
+
+void fill_binary_header(unsigned char *header, int rows, int cols, int format){
+  memset(header, 0, BINARY_HEADER_SIZE);
+  memcpy(header, BINARY_MAGIC, 4);
+  header[4] = BINARY_VERSION;
+  header[5] = (format == FORMAT_BINARY32) ? BINARY_FLOAT32 : BINARY_FLOAT64;
+  put_dimension(header + 8, rows);
+  put_dimension(header + 16, cols);
+}
+
+static int write_binary_header(FILE *out, int rows, int cols, int format){
+  unsigned char header[BINARY_HEADER_SIZE];
+  fill_binary_header(header, rows, cols, format);
+  return (fwrite(header, 1, sizeof(header), out) == sizeof(header)) ? 0 : -1;
+}
+
+/**
+ * Creates a float64 binary matrix file at path and returns a rows x cols matrix whose elements
+ * are the file's data section, mapped shared: whatever is stored into the matrix ends up in the
+ * file, and close_matrix_file flushes and closes it. Only possible on little-endian hosts, where the
+ * in-memory and on-disk layouts agree; NULL otherwise or on error.
+ */
+Matrix* create_matrix_file(const char *path, int rows, int cols){
+  size_t count, size;
+  unsigned char *base;
+  Matrix *matrix;
+  if (rows < 0 || cols < 0 || !host_is_little_endian()) {
+    return NULL;
+  }
+  count = (size_t)rows * (size_t)cols;
+  if (cols != 0 && count / (size_t)cols != (size_t)rows) {
+    return NULL; /* Error: size overflow */
+  }
+  if (count > ((size_t)-1 - BINARY_HEADER_SIZE) / sizeof(double)) {
+    return NULL;
+  }
+  size = BINARY_HEADER_SIZE + count * sizeof(double);
+  base = (unsigned char *)map_new_file(path, size);
+  if (base == NULL) {
+    return NULL;
+  }
+  fill_binary_header(base, rows, cols, FORMAT_BINARY);
+  matrix = matrix_from_buffer(rows, cols, (double *)(base + BINARY_HEADER_SIZE), base);
+  if (matrix == NULL) {
+    unmap_buffer(base, size);
+    return NULL;
+  }
+  matrix->mapped = size;
+  return matrix;
+}
+
+/* Waits until a matrix from create_matrix_file is on disk and frees it, 0 if it all got there */
+int close_matrix_file(Matrix *A){
+  int status = 0;
+  if (A == NULL){
+    return -1;
+  }
+  if (A->mapped > 0 && sync_mapping(A->block, A->mapped) != 0){
+    status = -1;
+  }
+  if (release_matrix(A) != 0){
+    status = -1;
+  }
+  return status;
+}
+
+/* Writes one row in binary form, converting it in place to the file's byte order and type */
+static int write_binary_row(FILE *out, double *row, int cols, int format){
+  int j, swap = !host_is_little_endian();
+  float *singles = (float *)row;
+  if (format == FORMAT_BINARY32) {
+    for (j = 0; j < cols; j++) {
+      singles[j] = (float)row[j]; /* front to back: float j never overlaps an unread double */
+      if (swap) {
+        reverse_bytes((unsigned char *)&singles[j], 4);
+      }
+    }
+    return (fwrite(singles, 4, (size_t)cols, out) == (size_t)cols) ? 0 : -1;
+  }
+  for (j = 0; swap && j < cols; j++) {
+    reverse_bytes((unsigned char *)&row[j], 8);
+  }
+  return (fwrite(row, 8, (size_t)cols, out) == (size_t)cols) ? 0 : -1;
+}
+
+/**
+ * Formats x exactly like printf("%.4f") and returns the number of characters written.
+ * For |x| < FIXED4_FAST_LIMIT, x * 10^4 fits in 53 bits, so rounding it to an integer and
+ * printing the digits is exact unless the product lies within its own rounding error of a
+ * .5 tie; those cases, huge values, inf and nan are left to sprintf.
+ */
+static int format_fixed4(double x, char *out){
+  double magnitude, scaled, whole, fraction, integer_part, high;
+  unsigned long low, frac_digits;
+  char digits[24];
+  int length = 0, count = 0, negative = (x < 0.0 || (x == 0.0 && 1.0 / x < 0.0));
+  magnitude = negative ? -x : x;
+  if (!(magnitude < FIXED4_FAST_LIMIT)) {
+    return sprintf(out, "%.4f", x);
+  }
+  scaled = magnitude * 10000.0;
+  whole = floor(scaled);
+  fraction = scaled - whole;
+  if (fabs(fraction - 0.5) <= scaled * 4.5e-16) {
+    return sprintf(out, "%.4f", x); /* too close to a tie to decide from the rounded product */
+  }
+  if (fraction > 0.5) {
+    whole += 1.0;
+  }
+  integer_part = floor(whole / 10000.0);
+  frac_digits = (unsigned long)(whole - integer_part * 10000.0);
+  if (negative) {
+    out[length++] = '-';
+  }
+  /* integer digits, in two parts that each fit an unsigned long */
+  high = floor(integer_part / 1e9);
+  low = (unsigned long)(integer_part - high * 1e9);
+  do {
+    digits[count++] = (char)('0' + low % 10);
+    low /= 10;
+  } while (low > 0);
+  if (high > 0) {
+    while (count < 9) {
+      digits[count++] = '0';
+    }
+    low = (unsigned long)high;
+    do {
+      digits[count++] = (char)('0' + low % 10);
+      low /= 10;
+    } while (low > 0);
+  }
+  while (count > 0) {
+    out[length++] = digits[--count];
+  }
+  out[length++] = '.';
+  out[length++] = (char)('0' + frac_digits / 1000);
+  out[length++] = (char)('0' + frac_digits / 100 % 10);
+  out[length++] = (char)('0' + frac_digits / 10 % 10);
+  out[length++] = (char)('0' + frac_digits % 10);
+  return length;
+}
+
+/* Output chunk that text rows are rendered into before being handed to stdio */
+typedef struct {
+    FILE *out;
+    char *buffer;
+    size_t used;
+} TextChunk;
+
+static int flush_chunk(TextChunk *chunk){
+  size_t used = chunk->used;
+  chunk->used = 0;
+  return (fwrite(chunk->buffer, 1, used, chunk->out) == used) ? 0 : -1;
+}
+
+static int write_text_row(TextChunk *chunk, const double *row, int cols){
+  int j;
+  if (cols == 0) {
+    if (chunk->used + 1 > TEXT_CHUNK && flush_chunk(chunk) != 0) {
+      return -1;
+    }
+    chunk->buffer[chunk->used++] = '\n';
+  }
+  for (j = 0; j < cols; j++) {
+    if (chunk->used + MAX_FIXED4_LENGTH + 1 > TEXT_CHUNK && flush_chunk(chunk) != 0) {
+      return -1;
+    }
+    chunk->used += (size_t)format_fixed4(row[j], chunk->buffer + chunk->used);
+    chunk->buffer[chunk->used++] = (j != cols - 1) ? ',' : '\n'; /* No comma at the last column */
+  }
+  return 0;
+}
+
+/* Text rows are rendered into a TEXT_CHUNK buffer and written with one fwrite per chunk */
+int write_rows(FILE *out, int rows, int cols, RowSource source, const void *context, int format){
+  void *block;
+  double *row;
+  TextChunk chunk;
+  ProfileMark mark;
+  int i, status = 0;
+  profile_start(&mark);
+  row = (double *)allocate_aligned((size_t)(cols > 0 ? cols : 1) * sizeof(double), &block);
+  chunk.out = out;
+  chunk.used = 0;
+  chunk.buffer = (format == FORMAT_TEXT) ? (char *)malloc(TEXT_CHUNK) : NULL;
+  if (row == NULL || (format == FORMAT_TEXT && chunk.buffer == NULL)) {
+    free(block);
+    free(chunk.buffer);
+    return -1;
+  }
+  if (format != FORMAT_TEXT) {
+    status = write_binary_header(out, rows, cols, format);
+  }
+  for (i = 0; status == 0 && i < rows; i++) {
+    source(context, i, row);
+    status = (format == FORMAT_TEXT) ? write_text_row(&chunk, row, cols)
+                                     : write_binary_row(out, row, cols, format);
+  }
+  if (status == 0 && chunk.used > 0) {
+    status = flush_chunk(&chunk);
+  }
+  free(block);
+  free(chunk.buffer);
+  if (fflush(out) != 0) {
+    status = -1;
+  }
+  profile_stop(&mark, "write_output");
+  return status;
+}
+
+static void dense_row(const void *source, int i, double *row){
+  const Matrix *X = (const Matrix *)source;
+  memcpy(row, MAT_ROW(X, i), (size_t)X->cols * sizeof(double));
+}
+
+static void packed_row(const void *source, int i, double *row){
+  const SymMatrix *S = (const SymMatrix *)source;
+  int j;
+  for (j = 0; j < i; j++) {
+    row[j] = SYM_ROW(S, j)[i - j];
+  }
+  memcpy(row + i, SYM_ROW(S, i), (size_t)(S->n - i) * sizeof(double));
+}
+
+static void diagonal_row(const void *source, int i, double *row){
+  const Matrix *d = (const Matrix *)source;
+  memset(row, 0, (size_t)d->rows * sizeof(double));
+  row[i] = d->data[i];
+}
+
+int write_matrix(FILE *out, Matrix *X, int format){
+  return write_rows(out, X->rows, X->cols, dense_row, X, format);
+}
+
+int write_sym_matrix(FILE *out, SymMatrix *S, int format){
+  return write_rows(out, S->n, S->n, packed_row, S, format);
+}
+
+static void sparse_row(const void *source, int i, double *row){
+  const SparseMatrix *S = (const SparseMatrix *)source;
+  size_t p;
+  memset(row, 0, (size_t)S->n * sizeof(double));
+  for (p = S->row_start[i]; p < S->row_start[i + 1]; p++) {
+    row[S->columns[p]] = S->values[p];
+  }
+}
+
+int write_sparse_matrix(FILE *out, SparseMatrix *S, int format){
+  return write_rows(out, S->n, S->n, sparse_row, S, format);
+}
+
+int write_diagonal(FILE *out, Matrix *d, int format){
+  return write_rows(out, d->rows, d->rows, diagonal_row, d, format);
+}
+
 void error_has_occured()
 {
   printf("An Error Has Occurred\n");
   exit(EXIT_FAILURE);
 }
-
@@ -1,10 +1,47 @@
+
 #ifndef UTILS_H
 #define UTILS_H
 
+#include <stdio.h>
 #include "mat_utils.h"
+#include "symmat.h"
+#include "sparse.h"
+
+/* Output formats, selected with --format */
+#define FORMAT_TEXT 0 /* comma separated, 4 decimals */
+#define FORMAT_BINARY 1 /* binary header + float64 */
+#define FORMAT_BINARY32 2 /* binary header + float32 */
+
+/**
+ * Binary matrix file layout (all integers little-endian):
+ *   bytes 0-3   magic "SNMF"
+ *   byte  4     version (BINARY_VERSION)
+ *   byte  5     element type: BINARY_FLOAT64 or BINARY_FLOAT32
+ *   bytes 6-7   reserved, zero
+ *   bytes 8-15  rows (unsigned 64 bit)
+ *   bytes 16-23 cols (unsigned 64 bit)
+ *   bytes 24-31 reserved, zero
+ * followed by rows * cols little-endian IEEE-754 elements in row-major order.
+ */
+#define BINARY_MAGIC "SNMF"
+#define BINARY_VERSION 1
+#define BINARY_FLOAT64 1
+#define BINARY_FLOAT32 2
+#define BINARY_HEADER_SIZE 32
 
-Matrix* file_to_matrix(char *filename);
+/* Writes row i of an n x cols matrix stored in some implicit form into row */
+typedef void (*RowSource)(const void *source, int i, double *row);
+
+Matrix* file_to_matrix(char *filename); /* text or binary, detected from the magic */
+Matrix* create_matrix_file(const char *path, int rows, int cols); /* float64 file, mapped writable */
+int close_matrix_file(Matrix *A); /* flushes and frees a create_matrix_file matrix, 0 on success */
+void fill_binary_header(unsigned char *header, int rows, int cols, int format);
+int write_rows(FILE *out, int rows, int cols, RowSource source, const void *context, int format);
+int write_matrix(FILE *out, Matrix *X, int format); /* all writers return 0 on success */
+int write_sym_matrix(FILE *out, SymMatrix *S, int format);
+int write_sparse_matrix(FILE *out, SparseMatrix *S, int format); /* written out densely */
+int write_diagonal(FILE *out, Matrix *d, int format); /* diag(d) for an n x 1 vector d */
+int parse_format(const char *name); /* "text", "binary" or "binary32", -1 if unknown */
 void error_has_occured();
 
 #endif
-